@@ -48,6 +48,12 @@ void parse_config_line(char *line) {
   } else if (strcmp(key, "hard-wrap") == 0) {
     E.hard_wrap = atoi(value);
     if (E.hard_wrap < 0) E.hard_wrap = 0;
+  } else if (strcmp(key, "huge-threshold") == 0) {
+    E.huge_threshold = atoi(value);
+    if (E.huge_threshold < 0) E.huge_threshold = 0;
+  } else if (strcmp(key, "highlight-on-load") == 0) {
+    E.highlight_on_load = atoi(value);
+    if (E.highlight_on_load < 0) E.highlight_on_load = 0;
   }
 }
 
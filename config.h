@@ -2,18 +2,28 @@
 #define CONFIG_H
 
 // We need this for the erow struct
+#include <sys/stat.h>
 #include <sys/types.h>
 
 typedef struct erow {
-  int idx;
   int size;
   int rsize;
   char *chars;
   char *render;
-  unsigned char *hl;
-  int hl_open_comment;
+  struct hlSpan *hl;    // runs of cells with the same highlight
+  int hl_spans;
+  int hl_start;         // inside a multi-line comment at the start of the row
+  int hl_open_comment;  // and at its end
+  unsigned int hl_gen;  // hl is current while this matches the buffer's
+  int flags;
+  unsigned int gen; // save generation chars were allocated in
+  off_t file_offset; // where the row starts in the file, if unchanged
 } erow;
 
+#define ROW_MAPPED (1<<0) // chars point into the buffer's file mapping
+#define ROW_STALE  (1<<1) // render has not been built yet
+#define ROW_RENDER_CHARS (1<<2) // render is chars itself, there being no tabs
+
 enum {
   COLOR_PAIR_NORMAL = 1,
   COLOR_PAIR_COMMENT,
@@ -25,13 +35,61 @@ enum {
   COLOR_PAIR_GUTTER
 };
 
+struct rope;
+struct lineLoader;
+struct hugeFile;
+struct saveJob;
+struct journal;
+struct hlJob;
+struct lineSig;
+
 struct Buffer {
   int cx, cy;
   int rx;
   int rowoff;
   int coloff;
   int numrows;
-  erow *row;
+  struct rope *rows;
+  int hl_valid;          // rows before this have correct hl
+  int hl_stale_end;      // edits since then were all before this row
+  int hl_done;           // and rows up to here were correct before them
+  unsigned int hl_gen;   // bumped when every row's hl goes out of date
+  unsigned int hl_edits; // bumped on every change to the rows
+  int hl_want_lo;        // rows drawn before they were highlighted
+  int hl_want_hi;
+  struct hlJob *hl_job;  // rows out with the highlighter thread, if any
+  int hl_job_first;
+  int hl_job_count;
+  unsigned int hl_job_edits; // hl_edits when the job started
+  int damage_lo;         // rows changed since the last frame
+  int damage_hi;
+  int wrap_width;        // text width the rope's row heights are for, or 0
+  int match_row;         // find match drawn over hl, -1 for none
+  int match_rx;
+  int match_len;
+  struct erow *gap_row;  // row being typed into, with a gap in its chars
+  int gap_at;            // where the gap starts
+  int gap_len;
+  char *map;
+  size_t map_size;
+  struct lineLoader *loader;
+  struct hugeFile *huge; // set when only a window of the file is in rows
+  int huge_first;        // line number of the first row in that window
+  int follow_fd;         // inotify descriptor while following, else -1
+  off_t follow_off;      // how much of the file is in rows
+  int follow_partial;    // the last row wasn't ended by a newline
+  struct saveJob *save;  // background save in progress, if any
+  int save_pending;      // save again once it's done
+  int save_dirty;        // dirty count the running save will clear
+  unsigned int save_gen; // bumped for every snapshot
+  char **orphans;        // row text the running save still points at
+  int numorphans;
+  int first_dirty;       // rows from here on may differ from the file
+  int save_first_dirty;  // first_dirty when the running save started
+  struct stat disk;      // the file as it was last read or written
+  int disk_valid;
+  struct journal *journal; // unsaved edits, for crash recovery
+  int journaling;        // edits are being recorded to the journal
   int dirty;
   char *filename;
   struct editorSyntax *syntax;
@@ -56,6 +114,12 @@ struct editorConfig {
   int quit_times;
   int soft_wrap;
   int hard_wrap;
+  int huge_files;     // open every file as a huge file (--huge)
+  int huge_threshold; // in MB, bigger files are opened as huge files
+  int highlight_on_load; // highlight whole files, not just what's shown
+  struct lineSig *drawn; // what each screen line showed last frame
+  int drawn_rows;
+  int drawn_cols;
 
   struct Buffer **buffers;
   int num_buffers;
@@ -64,7 +128,8 @@ struct editorConfig {
 
 enum editorActionType {
   ACTION_INSERT,
-  ACTION_DELETE
+  ACTION_DELETE,
+  ACTION_PASTE // text inserted in one go, possibly over several rows
 };
 
 typedef struct editorAction {
@@ -0,0 +1,235 @@
+#define _DEFAULT_SOURCE
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "highlight.h"
+
+#define HL_THREADS_MAX 8  // workers started, at most one per core
+#define HL_CHUNK_MIN 1024 // lines below which a job isn't worth splitting
+
+struct hlJob {
+  struct editorSyntax *syntax;
+  int in_comment;
+  char **lines;
+  int *lens;
+  int count;
+  hlSpan **hl;
+  int *nspans;
+  int *open;
+  int chunk;   // lines per chunk
+  int nchunks;
+  // Shared with the workers, under hlLock.
+  int claimed;  // chunks handed out to workers
+  int finished; // and chunks done with
+  int done;
+  int cancel;
+  struct hlJob *next;
+};
+
+static pthread_mutex_t hlLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t hlQueued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t hlFinished = PTHREAD_COND_INITIALIZER;
+static struct hlJob *hlHead; // jobs with chunks not yet handed out
+static struct hlJob *hlTail;
+static int hlWorkers; // threads running, -1 if none could be started
+
+/*** worker ***/
+
+static int hlCancelled(struct hlJob *j) {
+  pthread_mutex_lock(&hlLock);
+  int cancel = j->cancel;
+  pthread_mutex_unlock(&hlLock);
+  return cancel;
+}
+
+// Highlights line i into the scratch buffer *buf, growing it as needed,
+// and keeps the result as spans. Returns whether the line ends inside a
+// multi-line comment.
+static int hlLine(struct hlJob *j, int i, int in_comment, unsigned char **buf, int *cap) {
+  if (j->lens[i] > *cap) {
+    *cap = j->lens[i];
+    *buf = realloc(*buf, *cap);
+  }
+  in_comment = syntaxHighlight(j->syntax, j->lines[i], j->lens[i], in_comment, *buf);
+  free(j->hl[i]);
+  j->hl[i] = syntaxSpans(*buf, j->lens[i], &j->nspans[i]);
+  j->open[i] = in_comment;
+  return in_comment;
+}
+
+// Chunks after the first are highlighted as if they started outside a
+// multi-line comment, so each can go to a different worker.
+static void hlRunChunk(struct hlJob *j, int c, int threaded) {
+  int first = c * j->chunk;
+  int end = first + j->chunk < j->count ? first + j->chunk : j->count;
+  int in_comment = c == 0 ? j->in_comment : 0;
+  unsigned char *buf = NULL;
+  int cap = 0;
+  for (int i = first; i < end; i++) {
+    // Checking every line would cost more than the lines themselves.
+    if (threaded && i % 256 == 255 && hlCancelled(j)) break;
+    in_comment = hlLine(j, i, in_comment, &buf, &cap);
+  }
+  free(buf);
+}
+
+// Once every chunk is done, the lines at the top of a chunk that the
+// one before actually left inside a comment are highlighted again, until
+// one ends in the same state as it did the first time. Only a comment
+// left open for the rest of the job makes this go all the way down.
+static void hlJoinChunks(struct hlJob *j, int threaded) {
+  unsigned char *buf = NULL;
+  int cap = 0;
+  for (int c = 1; c < j->nchunks; c++) {
+    int i = c * j->chunk;
+    int end = i + j->chunk < j->count ? i + j->chunk : j->count;
+    int in_comment = j->open[i - 1];
+    int assumed = 0;
+    while (i < end && in_comment != assumed) {
+      if (threaded && i % 256 == 255 && hlCancelled(j)) break;
+      assumed = j->open[i];
+      in_comment = hlLine(j, i, in_comment, &buf, &cap);
+      i++;
+    }
+  }
+  free(buf);
+}
+
+// Workers take the chunks of the job at the head of the queue in turn.
+// Whichever finishes the last chunk of a job joins them up.
+static void *hlThread(void *arg) {
+  (void)arg;
+  pthread_mutex_lock(&hlLock);
+  while (1) {
+    while (hlHead == NULL) pthread_cond_wait(&hlQueued, &hlLock);
+    struct hlJob *j = hlHead;
+    int c = j->claimed++;
+    if (j->claimed == j->nchunks) {
+      hlHead = j->next;
+      if (hlHead == NULL) hlTail = NULL;
+    }
+    pthread_mutex_unlock(&hlLock);
+
+    hlRunChunk(j, c, 1);
+
+    pthread_mutex_lock(&hlLock);
+    if (++j->finished < j->nchunks) continue;
+    int cancel = j->cancel;
+    pthread_mutex_unlock(&hlLock);
+
+    if (!cancel) hlJoinChunks(j, 1);
+
+    pthread_mutex_lock(&hlLock);
+    j->done = 1;
+    pthread_cond_broadcast(&hlFinished);
+  }
+  return NULL;
+}
+
+static void hlStartWorkers() {
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  if (cores > HL_THREADS_MAX) cores = HL_THREADS_MAX;
+  for (long i = 0; i < cores || i == 0; i++) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, hlThread, NULL) != 0) break;
+    pthread_detach(thread);
+    hlWorkers++;
+  }
+  if (hlWorkers == 0) hlWorkers = -1;
+}
+
+/*** jobs ***/
+
+struct hlJob *hlJobStart(struct editorSyntax *syntax, int in_comment,
+                         char **lines, int *lens, int count) {
+  struct hlJob *j = calloc(1, sizeof(struct hlJob));
+  j->syntax = syntax;
+  j->in_comment = in_comment;
+  j->lines = lines;
+  j->lens = lens;
+  j->count = count;
+  j->hl = calloc(count, sizeof(hlSpan *));
+  j->nspans = calloc(count, sizeof(int));
+  j->open = calloc(count, sizeof(int));
+
+  pthread_mutex_lock(&hlLock);
+  if (hlWorkers == 0) hlStartWorkers();
+  j->chunk = count;
+  if (hlWorkers > 1) {
+    j->chunk = (count + hlWorkers - 1) / hlWorkers;
+    if (j->chunk < HL_CHUNK_MIN) j->chunk = HL_CHUNK_MIN;
+  }
+  if (j->chunk < 1) j->chunk = 1;
+  j->nchunks = (count + j->chunk - 1) / j->chunk;
+  if (j->nchunks < 1) j->nchunks = 1;
+  if (hlWorkers > 0) {
+    if (hlTail) hlTail->next = j;
+    else hlHead = j;
+    hlTail = j;
+    pthread_cond_broadcast(&hlQueued);
+  }
+  pthread_mutex_unlock(&hlLock);
+
+  if (hlWorkers == -1) {
+    hlRunChunk(j, 0, 0);
+    j->done = 1;
+  }
+  return j;
+}
+
+int hlJobThreads() {
+  pthread_mutex_lock(&hlLock);
+  if (hlWorkers == 0) hlStartWorkers();
+  int n = hlWorkers > 0 ? hlWorkers : 1;
+  pthread_mutex_unlock(&hlLock);
+  return n;
+}
+
+int hlJobDone(struct hlJob *j) {
+  pthread_mutex_lock(&hlLock);
+  int done = j->done;
+  pthread_mutex_unlock(&hlLock);
+  return done;
+}
+
+hlSpan *hlJobTake(struct hlJob *j, int i, int *nspans, int *open) {
+  hlSpan *hl = j->hl[i];
+  j->hl[i] = NULL;
+  *nspans = j->nspans[i];
+  *open = j->open[i];
+  return hl;
+}
+
+void hlJobFree(struct hlJob *j) {
+  pthread_mutex_lock(&hlLock);
+  if (!j->done) {
+    j->cancel = 1;
+    if (j->claimed < j->nchunks) {
+      // Still queued: take back the chunks no worker has started.
+      struct hlJob **p = &hlHead;
+      while (*p != j) p = &(*p)->next;
+      *p = j->next;
+      if (hlTail == j) {
+        hlTail = NULL;
+        for (struct hlJob *q = hlHead; q; q = q->next) hlTail = q;
+      }
+      j->finished += j->nchunks - j->claimed;
+      j->claimed = j->nchunks;
+      if (j->finished == j->nchunks) j->done = 1;
+    }
+    while (!j->done) pthread_cond_wait(&hlFinished, &hlLock);
+  }
+  pthread_mutex_unlock(&hlLock);
+
+  for (int i = 0; i < j->count; i++) {
+    free(j->lines[i]);
+    free(j->hl[i]);
+  }
+  free(j->lines);
+  free(j->lens);
+  free(j->hl);
+  free(j->nspans);
+  free(j->open);
+  free(j);
+}
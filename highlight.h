@@ -0,0 +1,35 @@
+#ifndef HIGHLIGHT_H
+#define HIGHLIGHT_H
+
+#include "syntax.h"
+
+/*** background highlighting ***/
+
+// Rows are highlighted on worker threads, so typing never waits for the
+// highlighter. A job is a run of consecutive lines, copied when it is
+// queued, highlighted carrying the multi-line comment state from one line
+// to the next. Big jobs are split into a chunk per worker, and the chunks
+// put back together once they are all done. Jobs are handled in the
+// order they were queued.
+struct hlJob;
+
+// Queues `count` lines, starting in_comment. The job takes over lines,
+// lens and the strings in lines, each of which has to be NUL terminated.
+// If the thread can't be started the job is done before this returns.
+struct hlJob *hlJobStart(struct editorSyntax *syntax, int in_comment,
+                         char **lines, int *lens, int count);
+int hlJobDone(struct hlJob *j);
+
+// How many workers the jobs are shared between, starting them if need be.
+int hlJobThreads();
+
+// Hands over the hl spans of line i of a finished job, storing how many
+// there are in *nspans and whether the line ends inside a multi-line
+// comment in *open. Each line's spans can only be taken once.
+hlSpan *hlJobTake(struct hlJob *j, int i, int *nspans, int *open);
+
+// Frees the job along with any hl not taken. A job that hasn't finished
+// is dropped from the queue, or stopped if the thread is on it.
+void hlJobFree(struct hlJob *j);
+
+#endif // HIGHLIGHT_H
@@ -0,0 +1,217 @@
+#define _DEFAULT_SOURCE
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "hugefile.h"
+
+#define HUGE_READ_BLOCK (1 << 20)
+
+struct hugeFile {
+  int fd;
+  off_t size;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  // Everything below is shared with the scan thread.
+  off_t *marks; // marks[i] is where line i * HUGE_INDEX_STRIDE starts
+  int nmarks;
+  int markcap;
+  int lines;
+  off_t scanned;
+  int done;
+  int cancel;
+};
+
+/*** indexing ***/
+
+static void hugeFilePushMark(struct hugeFile *h, off_t off) {
+  pthread_mutex_lock(&h->lock);
+  if (h->nmarks == h->markcap) {
+    h->markcap = h->markcap ? h->markcap * 2 : 1024;
+    h->marks = realloc(h->marks, sizeof(off_t) * h->markcap);
+  }
+  h->marks[h->nmarks++] = off;
+  pthread_mutex_unlock(&h->lock);
+}
+
+static void *hugeFileScan(void *arg) {
+  struct hugeFile *h = arg;
+  char *block = malloc(HUGE_READ_BLOCK);
+  off_t off = 0;
+  int lines = 0;
+  char last = '\n';
+
+  while (block && off < h->size) {
+    pthread_mutex_lock(&h->lock);
+    int cancel = h->cancel;
+    pthread_mutex_unlock(&h->lock);
+    if (cancel) break;
+
+    size_t want = h->size - off < HUGE_READ_BLOCK ? h->size - off : HUGE_READ_BLOCK;
+    ssize_t n = pread(h->fd, block, want, off);
+    if (n <= 0) break;
+
+    char *p = block;
+    char *end = block + n;
+    while ((p = memchr(p, '\n', end - p)) != NULL) {
+      p++;
+      lines++;
+      off_t start = off + (p - block);
+      if (lines % HUGE_INDEX_STRIDE == 0 && start < h->size) hugeFilePushMark(h, start);
+    }
+    last = end[-1];
+    off += n;
+
+    pthread_mutex_lock(&h->lock);
+    h->lines = lines;
+    h->scanned = off;
+    pthread_mutex_unlock(&h->lock);
+  }
+
+  // A last line without a newline still counts.
+  pthread_mutex_lock(&h->lock);
+  if (off == h->size && last != '\n') h->lines = lines + 1;
+  h->done = 1;
+  pthread_mutex_unlock(&h->lock);
+
+  free(block);
+  return NULL;
+}
+
+struct hugeFile *hugeFileOpen(int fd, off_t size) {
+  struct hugeFile *h = calloc(1, sizeof(struct hugeFile));
+  if (h == NULL) return NULL;
+  h->fd = fd;
+  h->size = size;
+  pthread_mutex_init(&h->lock, NULL);
+  hugeFilePushMark(h, 0);
+
+  if (pthread_create(&h->thread, NULL, hugeFileScan, h) != 0) {
+    pthread_mutex_destroy(&h->lock);
+    free(h->marks);
+    free(h);
+    return NULL;
+  }
+  return h;
+}
+
+void hugeFileClose(struct hugeFile *h) {
+  pthread_mutex_lock(&h->lock);
+  h->cancel = 1;
+  pthread_mutex_unlock(&h->lock);
+  pthread_join(h->thread, NULL);
+
+  close(h->fd);
+  pthread_mutex_destroy(&h->lock);
+  free(h->marks);
+  free(h);
+}
+
+int hugeFileLines(struct hugeFile *h) {
+  pthread_mutex_lock(&h->lock);
+  int lines = h->lines;
+  pthread_mutex_unlock(&h->lock);
+  return lines;
+}
+
+off_t hugeFileScanned(struct hugeFile *h) {
+  pthread_mutex_lock(&h->lock);
+  off_t scanned = h->scanned;
+  pthread_mutex_unlock(&h->lock);
+  return scanned;
+}
+
+off_t hugeFileSize(struct hugeFile *h) {
+  return h->size;
+}
+
+int hugeFileDone(struct hugeFile *h) {
+  pthread_mutex_lock(&h->lock);
+  int done = h->done;
+  pthread_mutex_unlock(&h->lock);
+  return done;
+}
+
+int hugeFileLineAt(struct hugeFile *h, off_t off) {
+  pthread_mutex_lock(&h->lock);
+  int lo = 0, hi = h->nmarks - 1;
+  while (lo < hi) {
+    int mid = (lo + hi + 1) / 2;
+    if (h->marks[mid] <= off) lo = mid;
+    else hi = mid - 1;
+  }
+  pthread_mutex_unlock(&h->lock);
+  return lo * HUGE_INDEX_STRIDE;
+}
+
+/*** reading ***/
+
+int hugeFileReadLines(struct hugeFile *h, int first, int last,
+                      int (*fn)(void *arg, int line, char *s, size_t len), void *arg) {
+  if (first < 0) first = 0;
+  if (first >= last) return 0;
+
+  pthread_mutex_lock(&h->lock);
+  int mark = first / HUGE_INDEX_STRIDE;
+  if (mark >= h->nmarks) mark = h->nmarks - 1;
+  off_t off = h->marks[mark];
+  pthread_mutex_unlock(&h->lock);
+
+  char *block = malloc(HUGE_READ_BLOCK);
+  char *buf = malloc(HUGE_MAX_LINE + 1);
+  if (block == NULL || buf == NULL) {
+    free(block);
+    free(buf);
+    return -1;
+  }
+
+  int line = mark * HUGE_INDEX_STRIDE;
+  size_t len = 0;
+  int ret = 0, stop = 0;
+  while (!stop && line < last && off < h->size) {
+    size_t want = h->size - off < HUGE_READ_BLOCK ? h->size - off : HUGE_READ_BLOCK;
+    ssize_t n = pread(h->fd, block, want, off);
+    if (n <= 0) {
+      ret = -1;
+      break;
+    }
+    off += n;
+
+    char *p = block;
+    char *end = block + n;
+    while (p < end && line < last) {
+      char *nl = memchr(p, '\n', end - p);
+      if (line >= first) {
+        size_t take = (nl ? nl : end) - p;
+        if (take > HUGE_MAX_LINE - len) take = HUGE_MAX_LINE - len;
+        memcpy(buf + len, p, take);
+        len += take;
+      }
+      if (nl == NULL) break;
+      p = nl + 1;
+
+      if (line >= first) {
+        while (len > 0 && buf[len - 1] == '\r') len--;
+        buf[len] = '\0';
+        if (fn(arg, line, buf, len)) {
+          stop = 1;
+          break;
+        }
+      }
+      line++;
+      len = 0;
+    }
+  }
+
+  // The file can end in the middle of a line.
+  if (ret == 0 && !stop && off >= h->size && line >= first && line < last) {
+    while (len > 0 && buf[len - 1] == '\r') len--;
+    buf[len] = '\0';
+    fn(arg, line, buf, len);
+  }
+
+  free(block);
+  free(buf);
+  return ret;
+}
@@ -0,0 +1,41 @@
+#ifndef HUGEFILE_H
+#define HUGEFILE_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/*** huge files ***/
+
+// Files too big to keep in memory are read from disk a few lines at a
+// time. A background thread scans the file once and records where every
+// HUGE_INDEX_STRIDE-th line starts, which is enough to get back to any
+// line with one short read. Nothing else about the file is kept around.
+
+#define HUGE_INDEX_STRIDE 1024
+#define HUGE_MAX_LINE (32 << 10) // longer lines are cut off at this length
+
+struct hugeFile;
+
+// Starts indexing the first `size` bytes of fd. The hugeFile owns fd
+// from here on and closes it in hugeFileClose.
+struct hugeFile *hugeFileOpen(int fd, off_t size);
+void hugeFileClose(struct hugeFile *h);
+
+// How many lines have been found so far, how far the scan has got, and
+// whether it has reached the end of the file.
+int hugeFileLines(struct hugeFile *h);
+off_t hugeFileScanned(struct hugeFile *h);
+off_t hugeFileSize(struct hugeFile *h);
+int hugeFileDone(struct hugeFile *h);
+
+// The nearest indexed line starting at or before byte offset `off`.
+int hugeFileLineAt(struct hugeFile *h, off_t off);
+
+// Calls fn on each of the lines [first, last) in order, until it returns
+// nonzero. Lines are passed NUL terminated and without their line ending,
+// and are only valid during the call. Returns -1 if the file can't be
+// read, 0 otherwise.
+int hugeFileReadLines(struct hugeFile *h, int first, int last,
+                      int (*fn)(void *arg, int line, char *s, size_t len), void *arg);
+
+#endif // HUGEFILE_H
@@ -0,0 +1,269 @@
+#define _DEFAULT_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "journal.h"
+
+#define JOURNAL_MAGIC "THAWEJ01"
+#define JOURNAL_HEADER 48
+#define JOURNAL_RECORD 13 // op, row, at, len
+#define JOURNAL_FLUSH_MS 1000
+#define JOURNAL_MAX_PENDING (1 << 20)
+
+struct journal {
+  int fd;
+  char *path;
+  off_t size; // bytes in the file
+  char *pending;
+  size_t pending_len;
+  size_t pending_cap;
+  struct timespec first_pending;
+  off_t mark;
+};
+
+/*** helpers ***/
+
+static void journalHeader(char *h, const struct stat *disk) {
+  uint64_t fields[5] = {
+    disk->st_dev, disk->st_ino, disk->st_size,
+    disk->st_mtim.tv_sec, disk->st_mtim.tv_nsec
+  };
+  memcpy(h, JOURNAL_MAGIC, 8);
+  memcpy(h + 8, fields, sizeof(fields));
+}
+
+static int journalWriteAll(int fd, const char *buf, size_t len, off_t off) {
+  while (len > 0) {
+    ssize_t n = pwrite(fd, buf, len, off);
+    if (n <= 0) return -1;
+    buf += n;
+    len -= n;
+    off += n;
+  }
+  return 0;
+}
+
+static long journalMsSince(struct timespec *t) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - t->tv_sec) * 1000 + (now.tv_nsec - t->tv_nsec) / 1000000;
+}
+
+char *journalPath(const char *filename) {
+  const char *slash = strrchr(filename, '/');
+  int dirlen = slash ? slash - filename + 1 : 0;
+  char *path = malloc(strlen(filename) + 10);
+  if (path == NULL) return NULL;
+  sprintf(path, "%.*s.%s.journal", dirlen, filename, filename + dirlen);
+  return path;
+}
+
+/*** writing ***/
+
+// Takes over fd, closing it if the journal can't be allocated.
+static struct journal *journalNew(int fd, const char *path, off_t size) {
+  struct journal *j = calloc(1, sizeof(struct journal));
+  if (j) j->path = strdup(path);
+  if (j == NULL || j->path == NULL) {
+    free(j);
+    close(fd);
+    errno = ENOMEM;
+    return NULL;
+  }
+  j->fd = fd;
+  j->size = size;
+  return j;
+}
+
+// fsync()s the directory holding path, so a rename into it survives a
+// crash. Filesystems that can't sync a directory say EINVAL.
+static int journalSyncDir(const char *path) {
+  const char *slash = strrchr(path, '/');
+  char *dir = slash ? strndup(path, slash - path + 1) : strdup(".");
+  if (dir == NULL) return -1;
+  int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  free(dir);
+  if (fd == -1) return -1;
+  int ret = fsync(fd) == -1 && errno != EINVAL ? -1 : 0;
+  close(fd);
+  return ret;
+}
+
+struct journal *journalCreate(const char *path, const struct stat *disk) {
+  int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd == -1) return NULL;
+
+  char h[JOURNAL_HEADER];
+  journalHeader(h, disk);
+  if (journalWriteAll(fd, h, sizeof(h), 0) == -1 || fdatasync(fd) == -1) {
+    close(fd);
+    unlink(path);
+    return NULL;
+  }
+  struct journal *j = journalNew(fd, path, JOURNAL_HEADER);
+  if (j == NULL) unlink(path);
+  return j;
+}
+
+struct journal *journalResume(const char *path) {
+  int fd = open(path, O_RDWR | O_CLOEXEC);
+  if (fd == -1) return NULL;
+  off_t size = lseek(fd, 0, SEEK_END);
+  if (size < JOURNAL_HEADER) {
+    close(fd);
+    return NULL;
+  }
+  return journalNew(fd, path, size);
+}
+
+void journalAdd(struct journal *j, int op, int row, int at, const char *s, int len) {
+  size_t need = j->pending_len + JOURNAL_RECORD + (s ? len : 0);
+  if (need > j->pending_cap) {
+    j->pending_cap = need * 2;
+    j->pending = realloc(j->pending, j->pending_cap);
+  }
+  if (j->pending_len == 0) clock_gettime(CLOCK_MONOTONIC, &j->first_pending);
+
+  char *p = j->pending + j->pending_len;
+  uint32_t fields[3] = {row, at, len};
+  p[0] = op;
+  memcpy(p + 1, fields, sizeof(fields));
+  if (s) memcpy(p + JOURNAL_RECORD, s, len);
+  j->pending_len = need;
+
+  if (j->pending_len >= JOURNAL_MAX_PENDING) journalFlush(j);
+}
+
+int journalPending(struct journal *j) {
+  return j->pending_len > 0;
+}
+
+int journalDue(struct journal *j) {
+  return j->pending_len > 0 && journalMsSince(&j->first_pending) >= JOURNAL_FLUSH_MS;
+}
+
+static int journalWritePending(struct journal *j) {
+  if (j->pending_len == 0) return 0;
+  if (journalWriteAll(j->fd, j->pending, j->pending_len, j->size) == -1) return -1;
+  j->size += j->pending_len;
+  j->pending_len = 0;
+  return 0;
+}
+
+int journalFlush(struct journal *j) {
+  if (j->pending_len == 0) return 0;
+  if (journalWritePending(j) == -1) return -1;
+  return fdatasync(j->fd);
+}
+
+void journalMark(struct journal *j) {
+  j->mark = j->size + j->pending_len;
+}
+
+struct journal *journalRebase(struct journal *j, const struct stat *disk) {
+  if (journalWritePending(j) == -1) return j;
+  if (j->mark >= j->size) {
+    journalDiscard(j);
+    return NULL;
+  }
+
+  // Keep what came after the mark, behind a header for the new file. It
+  // goes into a new journal that replaces the old one only once it's on
+  // disk, so a crash part way through still leaves a whole journal.
+  size_t keep = j->size - j->mark;
+  char *buf = malloc(JOURNAL_HEADER + keep);
+  char *tmp = malloc(strlen(j->path) + 8);
+  if (buf == NULL || tmp == NULL) {
+    free(buf);
+    free(tmp);
+    return j;
+  }
+  journalHeader(buf, disk);
+  sprintf(tmp, "%s.XXXXXX", j->path);
+
+  int fd = -1;
+  if (pread(j->fd, buf + JOURNAL_HEADER, keep, j->mark) == (ssize_t)keep)
+    fd = mkstemp(tmp);
+  if (fd != -1) {
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    if (journalWriteAll(fd, buf, JOURNAL_HEADER + keep, 0) == 0 &&
+        fdatasync(fd) == 0 && rename(tmp, j->path) == 0) {
+      journalSyncDir(j->path);
+      close(j->fd);
+      j->fd = fd;
+      j->size = JOURNAL_HEADER + keep;
+    } else {
+      close(fd);
+      unlink(tmp);
+    }
+  }
+  free(tmp);
+  free(buf);
+  return j;
+}
+
+void journalDiscard(struct journal *j) {
+  close(j->fd);
+  unlink(j->path);
+  free(j->path);
+  free(j->pending);
+  free(j);
+}
+
+/*** recovery ***/
+
+int journalCheck(const char *path, const struct stat *disk) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) return 0;
+
+  char h[JOURNAL_HEADER], want[JOURNAL_HEADER];
+  ssize_t n = pread(fd, h, sizeof(h), 0);
+  close(fd);
+
+  journalHeader(want, disk);
+  if (n != JOURNAL_HEADER || memcmp(h, want, JOURNAL_HEADER) != 0) return -1;
+  return 1;
+}
+
+int journalReplay(const char *path,
+                  int (*fn)(void *arg, int op, int row, int at, const char *s, int len),
+                  void *arg) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) return -1;
+
+  off_t size = lseek(fd, 0, SEEK_END);
+  char *buf = size > 0 ? malloc(size) : NULL;
+  if (buf == NULL || pread(fd, buf, size, 0) != size) {
+    free(buf);
+    close(fd);
+    return -1;
+  }
+  close(fd);
+
+  int count = 0;
+  off_t off = JOURNAL_HEADER;
+  while (off + JOURNAL_RECORD <= size) {
+    uint32_t fields[3];
+    int op = (unsigned char)buf[off];
+    memcpy(fields, buf + off + 1, sizeof(fields));
+    int has_data = op == JOURNAL_INSERT_ROW || op == JOURNAL_INSERT;
+    off_t end = off + JOURNAL_RECORD + (has_data ? fields[2] : 0);
+    if (end > size) break;
+
+    if (fn(arg, op, fields[0], fields[1], has_data ? buf + off + JOURNAL_RECORD : NULL, fields[2])) {
+      count = -1;
+      break;
+    }
+    count++;
+    off = end;
+  }
+
+  free(buf);
+  return count;
+}
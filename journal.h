@@ -0,0 +1,67 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <sys/stat.h>
+
+/*** journal ***/
+
+// Every change to a buffer's rows is appended to a journal file next to
+// the file being edited, so unsaved work survives a crash. A journal
+// starts from the file as it was on disk when it was created, and
+// replaying its records onto that file gets the buffer back. Records are
+// collected in memory and written out together by journalFlush.
+
+enum journalOp {
+  JOURNAL_INSERT_ROW = 1, // insert row `row` holding the data
+  JOURNAL_DELETE_ROW,     // delete row `row`
+  JOURNAL_INSERT,         // insert the data into row `row` at `at`
+  JOURNAL_DELETE          // delete `len` chars from row `row` at `at`
+};
+
+struct journal;
+
+// The journal path for a file: ".name.journal" in the same directory,
+// or NULL if out of memory.
+char *journalPath(const char *filename);
+
+// Starts a new journal for the file described by disk, replacing any
+// old one, or carries on appending to the journal at path.
+struct journal *journalCreate(const char *path, const struct stat *disk);
+struct journal *journalResume(const char *path);
+
+// Returns 1 if path holds a journal made for the file described by disk,
+// 0 if there is no journal, and -1 if there is one for another version
+// of the file.
+int journalCheck(const char *path, const struct stat *disk);
+
+// Calls fn on each record in the journal at path, in order, until it
+// returns nonzero. A record cut short by a crash is left out. Returns
+// the number of records replayed, or -1 if fn gave up or the journal
+// can't be read.
+int journalReplay(const char *path,
+                  int (*fn)(void *arg, int op, int row, int at, const char *s, int len),
+                  void *arg);
+
+void journalAdd(struct journal *j, int op, int row, int at, const char *s, int len);
+
+// Whether records have been waiting longer than the flush interval.
+int journalDue(struct journal *j);
+int journalPending(struct journal *j);
+
+// Writes out waiting records and fdatasync()s the journal. Returns -1 on
+// error.
+int journalFlush(struct journal *j);
+
+// Saving: journalMark is called when the buffer is snapshotted, and once
+// the snapshot is on disk journalRebase restarts the journal from the
+// new file, keeping only the records made after the mark. If there are
+// none the journal is removed and NULL returned. The rebased journal is
+// written beside the old one and renamed over it; if that fails the old
+// journal is kept as it was.
+void journalMark(struct journal *j);
+struct journal *journalRebase(struct journal *j, const struct stat *disk);
+
+// Closes and deletes the journal.
+void journalDiscard(struct journal *j);
+
+#endif // JOURNAL_H
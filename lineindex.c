@@ -0,0 +1,313 @@
+#define _DEFAULT_SOURCE
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "lineindex.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define LINEINDEX_X86 1
+#endif
+
+#define LINEINDEX_MAX_THREADS 8
+#define LINEINDEX_MIN_CHUNK (4 << 20)
+
+struct offsets {
+  size_t *v;
+  size_t len;
+  size_t cap;
+  int failed; // ran out of memory, so some offsets are missing
+};
+
+static void offsetsPush(struct offsets *o, size_t off) {
+  if (o->len == o->cap) {
+    size_t cap = o->cap ? o->cap * 2 : 1024;
+    size_t *v = realloc(o->v, sizeof(size_t) * cap);
+    if (v == NULL) {
+      o->failed = 1;
+      return;
+    }
+    o->v = v;
+    o->cap = cap;
+  }
+  o->v[o->len++] = off;
+}
+
+/*** scanning ***/
+
+// Every scanner records the offset just past each '\n' in [start, end).
+
+static void scanScalar(const char *data, size_t start, size_t end, struct offsets *o) {
+  const char *p = data + start;
+  const char *stop = data + end;
+  while (p < stop && (p = memchr(p, '\n', stop - p)) != NULL) {
+    offsetsPush(o, p - data + 1);
+    p++;
+  }
+}
+
+#if defined(LINEINDEX_X86) && defined(__SSE2__)
+static void scanSse2(const char *data, size_t start, size_t end, struct offsets *o) {
+  const __m128i nl = _mm_set1_epi8('\n');
+  size_t i = start;
+  for (; i + 16 <= end; i += 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i *)(data + i));
+    unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, nl));
+    while (mask) {
+      offsetsPush(o, i + __builtin_ctz(mask) + 1);
+      mask &= mask - 1;
+    }
+  }
+  scanScalar(data, i, end, o);
+}
+#endif
+
+#ifdef LINEINDEX_X86
+__attribute__((target("avx2")))
+static void scanAvx2(const char *data, size_t start, size_t end, struct offsets *o) {
+  const __m256i nl = _mm256_set1_epi8('\n');
+  size_t i = start;
+  for (; i + 32 <= end; i += 32) {
+    __m256i chunk = _mm256_loadu_si256((const __m256i *)(data + i));
+    unsigned int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, nl));
+    while (mask) {
+      offsetsPush(o, i + __builtin_ctz(mask) + 1);
+      mask &= mask - 1;
+    }
+  }
+  scanScalar(data, i, end, o);
+}
+#endif
+
+static void scan(const char *data, size_t start, size_t end, struct offsets *o) {
+#ifdef LINEINDEX_X86
+  if (__builtin_cpu_supports("avx2")) {
+    scanAvx2(data, start, end, o);
+    return;
+  }
+#endif
+#if defined(LINEINDEX_X86) && defined(__SSE2__)
+  scanSse2(data, start, end, o);
+#else
+  scanScalar(data, start, end, o);
+#endif
+}
+
+/*** threads ***/
+
+struct scanJob {
+  const char *data;
+  size_t start;
+  size_t end;
+  struct offsets out;
+};
+
+static void *scanThread(void *arg) {
+  struct scanJob *job = arg;
+  scan(job->data, job->start, job->end, &job->out);
+  return NULL;
+}
+
+static int lineIndexThreads(size_t size) {
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if (cpus < 1) cpus = 1;
+  if (cpus > LINEINDEX_MAX_THREADS) cpus = LINEINDEX_MAX_THREADS;
+
+  size_t chunks = size / LINEINDEX_MIN_CHUNK;
+  if (chunks < 1) chunks = 1;
+  return chunks < (size_t)cpus ? (int)chunks : (int)cpus;
+}
+
+size_t *lineIndexBuild(const char *data, size_t size, size_t *count) {
+  *count = 0;
+  if (size == 0) return NULL;
+
+  int nthreads = lineIndexThreads(size);
+  struct scanJob jobs[LINEINDEX_MAX_THREADS];
+  pthread_t tids[LINEINDEX_MAX_THREADS];
+  int started[LINEINDEX_MAX_THREADS];
+
+  // Chunks can split anywhere, every newline is found by exactly one job.
+  size_t chunk = size / nthreads;
+  for (int t = 0; t < nthreads; t++) {
+    jobs[t].data = data;
+    jobs[t].start = t * chunk;
+    jobs[t].end = (t == nthreads - 1) ? size : (t + 1) * chunk;
+    memset(&jobs[t].out, 0, sizeof(jobs[t].out));
+  }
+
+  // The last chunk runs on the calling thread, and any chunk whose
+  // thread can't be started is scanned inline as well.
+  for (int t = 0; t < nthreads - 1; t++)
+    started[t] = pthread_create(&tids[t], NULL, scanThread, &jobs[t]) == 0;
+  scanThread(&jobs[nthreads - 1]);
+  for (int t = 0; t < nthreads - 1; t++) {
+    if (started[t]) pthread_join(tids[t], NULL);
+    else scanThread(&jobs[t]);
+  }
+
+  size_t total = 1;
+  int failed = 0;
+  for (int t = 0; t < nthreads; t++) {
+    total += jobs[t].out.len;
+    failed |= jobs[t].out.failed;
+  }
+
+  size_t *starts = failed ? NULL : malloc(sizeof(size_t) * total);
+  if (starts == NULL) {
+    for (int t = 0; t < nthreads; t++) free(jobs[t].out.v);
+    return NULL;
+  }
+
+  size_t n = 0;
+  starts[n++] = 0;
+  for (int t = 0; t < nthreads; t++) {
+    memcpy(&starts[n], jobs[t].out.v, sizeof(size_t) * jobs[t].out.len);
+    n += jobs[t].out.len;
+    free(jobs[t].out.v);
+  }
+  if (starts[n - 1] == size) n--;
+
+  *count = n;
+  return starts;
+}
+
+/*** background loading ***/
+
+#define LOADER_FIRST_SEGMENT (64 << 10)
+#define LOADER_MAX_SEGMENT (16 << 20)
+
+struct loaderSegment {
+  size_t *starts;
+  size_t count;
+  size_t end;
+  struct loaderSegment *next;
+};
+
+struct lineLoader {
+  const char *data;
+  size_t size;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  struct loaderSegment *head;
+  struct loaderSegment *tail;
+  size_t taken;
+  int cancel;
+  int failed; // ran out of memory, and stopped
+  int joined; // the thread has finished and been joined
+};
+
+static void *loaderThread(void *arg) {
+  struct lineLoader *l = arg;
+  size_t segsize = LOADER_FIRST_SEGMENT;
+  size_t start = 0;
+
+  while (start < l->size) {
+    pthread_mutex_lock(&l->lock);
+    int cancel = l->cancel;
+    pthread_mutex_unlock(&l->lock);
+    if (cancel) break;
+
+    size_t end = l->size;
+    if (start + segsize < l->size) {
+      const char *nl = memchr(l->data + start + segsize, '\n', l->size - start - segsize);
+      if (nl) end = nl - l->data + 1;
+    }
+
+    // Segments are never empty, so no line starts means no memory.
+    struct loaderSegment *seg = malloc(sizeof(struct loaderSegment));
+    if (seg) seg->starts = lineIndexBuild(l->data + start, end - start, &seg->count);
+    if (seg == NULL || seg->starts == NULL) {
+      free(seg);
+      pthread_mutex_lock(&l->lock);
+      l->failed = 1;
+      pthread_mutex_unlock(&l->lock);
+      break;
+    }
+    for (size_t i = 0; i < seg->count; i++) seg->starts[i] += start;
+    seg->end = end;
+    seg->next = NULL;
+
+    pthread_mutex_lock(&l->lock);
+    if (l->tail) l->tail->next = seg;
+    else l->head = seg;
+    l->tail = seg;
+    pthread_mutex_unlock(&l->lock);
+
+    start = end;
+    if (segsize < LOADER_MAX_SEGMENT) segsize *= 2;
+  }
+  return NULL;
+}
+
+struct lineLoader *lineLoaderStart(const char *data, size_t size) {
+  struct lineLoader *l = calloc(1, sizeof(struct lineLoader));
+  if (l == NULL) return NULL;
+  l->data = data;
+  l->size = size;
+  pthread_mutex_init(&l->lock, NULL);
+
+  if (pthread_create(&l->thread, NULL, loaderThread, l) != 0) {
+    pthread_mutex_destroy(&l->lock);
+    free(l);
+    return NULL;
+  }
+  return l;
+}
+
+int lineLoaderTake(struct lineLoader *l, size_t **starts, size_t *count, size_t *end) {
+  pthread_mutex_lock(&l->lock);
+  struct loaderSegment *seg = l->head;
+  if (seg) {
+    l->head = seg->next;
+    if (l->head == NULL) l->tail = NULL;
+  }
+  pthread_mutex_unlock(&l->lock);
+
+  if (seg == NULL) return 0;
+  *starts = seg->starts;
+  *count = seg->count;
+  *end = seg->end;
+  l->taken = seg->end;
+  free(seg);
+  return 1;
+}
+
+size_t lineLoaderTaken(struct lineLoader *l) {
+  return l->taken;
+}
+
+int lineLoaderDone(struct lineLoader *l) {
+  return l->taken >= l->size;
+}
+
+int lineLoaderFailed(struct lineLoader *l) {
+  pthread_mutex_lock(&l->lock);
+  int failed = l->failed && l->head == NULL;
+  pthread_mutex_unlock(&l->lock);
+  return failed;
+}
+
+void lineLoaderWait(struct lineLoader *l) {
+  if (l->joined) return;
+  pthread_join(l->thread, NULL);
+  l->joined = 1;
+}
+
+void lineLoaderFree(struct lineLoader *l) {
+  pthread_mutex_lock(&l->lock);
+  l->cancel = 1;
+  pthread_mutex_unlock(&l->lock);
+  lineLoaderWait(l);
+
+  while (l->head) {
+    struct loaderSegment *seg = l->head;
+    l->head = seg->next;
+    free(seg->starts);
+    free(seg);
+  }
+  pthread_mutex_destroy(&l->lock);
+  free(l);
+}
@@ -0,0 +1,44 @@
+#ifndef LINEINDEX_H
+#define LINEINDEX_H
+
+#include <stddef.h>
+
+/*** line index ***/
+
+// Returns the byte offset of every line start in data, in order, and
+// stores how many there are in *count. A trailing newline does not start
+// another line, so an empty input has no lines. The scan is split into
+// chunks handled by a small pool of threads, each finding newlines with
+// SIMD compares where the CPU supports them. Free the result with free().
+size_t *lineIndexBuild(const char *data, size_t size, size_t *count);
+
+/*** background loading ***/
+
+// A loader indexes data on its own thread, a segment at a time. The
+// first segments are small so the start of a file shows up right away.
+// Segments always end just after a newline or at the end of the data.
+struct lineLoader;
+
+struct lineLoader *lineLoaderStart(const char *data, size_t size);
+
+// Hands over the next indexed segment if one is ready: the absolute
+// offsets of its line starts, their count, and the offset where the
+// segment ends. Returns 0 when nothing is waiting.
+int lineLoaderTake(struct lineLoader *l, size_t **starts, size_t *count, size_t *end);
+
+// Bytes handed over so far through lineLoaderTake, and whether that
+// covers all of the data.
+size_t lineLoaderTaken(struct lineLoader *l);
+int lineLoaderDone(struct lineLoader *l);
+
+// Whether the loader ran out of memory and stopped short of the end, once
+// every segment indexed before that has been taken.
+int lineLoaderFailed(struct lineLoader *l);
+
+// Blocks until every segment has been indexed, or the loader has failed.
+void lineLoaderWait(struct lineLoader *l);
+
+// Stops the loader thread if it is still running and frees the loader.
+void lineLoaderFree(struct lineLoader *l);
+
+#endif // LINEINDEX_H
@@ -0,0 +1,284 @@
+#include <stdlib.h>
+#include "rope.h"
+
+/*** helpers ***/
+
+static unsigned int rope_seed = 2463534242u;
+
+static unsigned int ropeRandom() {
+  // xorshift32, good enough to keep the treap balanced
+  rope_seed ^= rope_seed << 13;
+  rope_seed ^= rope_seed >> 17;
+  rope_seed ^= rope_seed << 5;
+  return rope_seed;
+}
+
+static int ropeCount(struct ropeNode *t) {
+  return t ? t->count : 0;
+}
+
+static int ropeHeights(struct ropeNode *t) {
+  return t ? t->heights : 0;
+}
+
+static void ropePull(struct ropeNode *t) {
+  t->count = 1 + ropeCount(t->left) + ropeCount(t->right);
+  t->heights = t->height + ropeHeights(t->left) + ropeHeights(t->right);
+  if (t->left) t->left->parent = t;
+  if (t->right) t->right->parent = t;
+}
+
+// Splits t so that the first k rows end up in *l and the rest in *r.
+static void ropeSplit(struct ropeNode *t, int k, struct ropeNode **l, struct ropeNode **r) {
+  if (t == NULL) {
+    *l = *r = NULL;
+    return;
+  }
+  if (ropeCount(t->left) < k) {
+    ropeSplit(t->right, k - ropeCount(t->left) - 1, &t->right, r);
+    *l = t;
+  } else {
+    ropeSplit(t->left, k, l, &t->left);
+    *r = t;
+  }
+  ropePull(t);
+}
+
+static struct ropeNode *ropeMerge(struct ropeNode *a, struct ropeNode *b) {
+  if (a == NULL) return b;
+  if (b == NULL) return a;
+  if (a->prio > b->prio) {
+    a->right = ropeMerge(a->right, b);
+    ropePull(a);
+    return a;
+  }
+  b->left = ropeMerge(a, b->left);
+  ropePull(b);
+  return b;
+}
+
+/*** rope operations ***/
+
+void ropeInit(struct rope *r) {
+  r->root = NULL;
+  r->slabs = NULL;
+  r->numslabs = 0;
+}
+
+int ropeSize(struct rope *r) {
+  return ropeCount(r->root);
+}
+
+erow *ropeAt(struct rope *r, int at) {
+  struct ropeNode *t = r->root;
+  if (at < 0 || at >= ropeCount(t)) return NULL;
+
+  while (t) {
+    int left = ropeCount(t->left);
+    if (at < left) {
+      t = t->left;
+    } else if (at == left) {
+      return &t->row;
+    } else {
+      at -= left + 1;
+      t = t->right;
+    }
+  }
+  return NULL;
+}
+
+erow *ropeInsert(struct rope *r, int at) {
+  if (at < 0 || at > ropeCount(r->root)) return NULL;
+
+  struct ropeNode *node = calloc(1, sizeof(struct ropeNode));
+  if (node == NULL) return NULL;
+  node->count = 1;
+  node->prio = ropeRandom() >> 1;
+
+  struct ropeNode *left, *right;
+  ropeSplit(r->root, at, &left, &right);
+  r->root = ropeMerge(ropeMerge(left, node), right);
+  r->root->parent = NULL;
+  return &node->row;
+}
+
+void ropeRemove(struct rope *r, erow *row) {
+  struct ropeNode *t = (struct ropeNode *)row;
+  struct ropeNode *p = t->parent;
+
+  // The merged children have lower priority than t, so they can take
+  // its place directly without disturbing the rest of the tree.
+  struct ropeNode *m = ropeMerge(t->left, t->right);
+  if (m) m->parent = p;
+  if (p == NULL) {
+    r->root = m;
+  } else if (p->left == t) {
+    p->left = m;
+  } else {
+    p->right = m;
+  }
+  for (; p; p = p->parent) {
+    p->count--;
+    p->heights -= t->height;
+  }
+
+  if (!t->slab) free(t);
+}
+
+int ropeIndex(erow *row) {
+  struct ropeNode *t = (struct ropeNode *)row;
+  int idx = ropeCount(t->left);
+  while (t->parent) {
+    if (t == t->parent->right) idx += ropeCount(t->parent->left) + 1;
+    t = t->parent;
+  }
+  return idx;
+}
+
+erow *ropeNext(erow *row) {
+  struct ropeNode *t = (struct ropeNode *)row;
+  if (t->right) {
+    t = t->right;
+    while (t->left) t = t->left;
+    return &t->row;
+  }
+  while (t->parent && t == t->parent->right) t = t->parent;
+  return t->parent ? &t->parent->row : NULL;
+}
+
+erow *ropePrev(erow *row) {
+  struct ropeNode *t = (struct ropeNode *)row;
+  if (t->left) {
+    t = t->left;
+    while (t->right) t = t->right;
+    return &t->row;
+  }
+  while (t->parent && t == t->parent->left) t = t->parent;
+  return t->parent ? &t->parent->row : NULL;
+}
+
+static void ropeFreeNode(struct ropeNode *t, void (*free_row)(erow *)) {
+  if (t == NULL) return;
+  ropeFreeNode(t->left, free_row);
+  ropeFreeNode(t->right, free_row);
+  if (free_row) free_row(&t->row);
+  if (!t->slab) free(t);
+}
+
+void ropeFree(struct rope *r, void (*free_row)(erow *)) {
+  ropeFreeNode(r->root, free_row);
+  r->root = NULL;
+  for (int i = 0; i < r->numslabs; i++) free(r->slabs[i]);
+  free(r->slabs);
+  r->slabs = NULL;
+  r->numslabs = 0;
+}
+
+/*** heights ***/
+
+void ropeSetHeight(erow *row, int height) {
+  struct ropeNode *t = (struct ropeNode *)row;
+  int delta = height - t->height;
+  if (delta == 0) return;
+  t->height = height;
+  for (; t; t = t->parent) t->heights += delta;
+}
+
+static void ropeSetHeightsNode(struct ropeNode *t, int (*height)(erow *)) {
+  if (t == NULL) return;
+  ropeSetHeightsNode(t->left, height);
+  ropeSetHeightsNode(t->right, height);
+  t->height = height(&t->row);
+  t->heights = t->height + ropeHeights(t->left) + ropeHeights(t->right);
+}
+
+void ropeSetHeights(struct rope *r, int (*height)(erow *)) {
+  ropeSetHeightsNode(r->root, height);
+}
+
+int ropeHeight(struct rope *r) {
+  return ropeHeights(r->root);
+}
+
+int ropeHeightBefore(erow *row) {
+  struct ropeNode *t = (struct ropeNode *)row;
+  int line = ropeHeights(t->left);
+  while (t->parent) {
+    if (t == t->parent->right) line += ropeHeights(t->parent->left) + t->parent->height;
+    t = t->parent;
+  }
+  return line;
+}
+
+// The row that screen line `line` falls in, with *offset set to which of
+// its lines it is. NULL past the last row.
+erow *ropeAtHeight(struct rope *r, int line, int *offset) {
+  struct ropeNode *t = r->root;
+  if (line < 0 || line >= ropeHeights(t)) return NULL;
+
+  while (t) {
+    int left = ropeHeights(t->left);
+    if (line < left) {
+      t = t->left;
+    } else if (line < left + t->height) {
+      *offset = line - left;
+      return &t->row;
+    } else {
+      line -= left + t->height;
+      t = t->right;
+    }
+  }
+  return NULL;
+}
+
+/*** bulk loading ***/
+
+struct ropeNode *ropeNewSlab(struct rope *r, int n) {
+  struct ropeNode *nodes = calloc(n, sizeof(struct ropeNode));
+  if (nodes == NULL) return NULL;
+
+  struct ropeNode **slabs = realloc(r->slabs, sizeof(struct ropeNode *) * (r->numslabs + 1));
+  if (slabs == NULL) {
+    free(nodes);
+    return NULL;
+  }
+  r->slabs = slabs;
+  r->slabs[r->numslabs++] = nodes;
+
+  for (int i = 0; i < n; i++) nodes[i].slab = 1;
+  return nodes;
+}
+
+static void ropeFixCounts(struct ropeNode *t) {
+  if (t == NULL) return;
+  ropeFixCounts(t->left);
+  ropeFixCounts(t->right);
+  ropePull(t);
+}
+
+int ropeAppendSlab(struct rope *r, struct ropeNode *nodes, int n) {
+  if (n <= 0) return 0;
+
+  // Build the treap for the slab left to right, keeping its right spine
+  // on a stack, then hang it off the end of the existing tree.
+  struct ropeNode **spine = malloc(sizeof(struct ropeNode *) * n);
+  if (spine == NULL) return -1;
+  int depth = 0;
+  for (int i = 0; i < n; i++) {
+    struct ropeNode *t = &nodes[i];
+    struct ropeNode *last = NULL;
+    t->prio = ropeRandom() >> 1;
+    t->left = t->right = t->parent = NULL;
+    while (depth > 0 && spine[depth - 1]->prio < t->prio) last = spine[--depth];
+    t->left = last;
+    if (depth > 0) spine[depth - 1]->right = t;
+    spine[depth++] = t;
+  }
+  struct ropeNode *built = spine[0];
+  free(spine);
+
+  ropeFixCounts(built);
+  r->root = ropeMerge(r->root, built);
+  r->root->parent = NULL;
+  return 0;
+}
@@ -0,0 +1,55 @@
+#ifndef ROPE_H
+#define ROPE_H
+
+#include "config.h"
+
+/*** rope ***/
+
+// The rows of a buffer are kept in an implicit treap ordered by line
+// number. Every node carries the size of its subtree, so finding,
+// inserting and deleting a row are all O(log n), and an erow pointer
+// stays valid until that row is removed.
+
+struct ropeNode {
+  erow row; // must stay first, an erow * is also a struct ropeNode *
+  struct ropeNode *left;
+  struct ropeNode *right;
+  struct ropeNode *parent;
+  int count;
+  int height;  // screen lines the row takes up, when soft wrapped
+  int heights; // sum of height over the subtree
+  unsigned int prio : 31;
+  unsigned int slab : 1; // allocated as part of a slab, not on its own
+};
+
+struct rope {
+  struct ropeNode *root;
+  struct ropeNode **slabs;
+  int numslabs;
+};
+
+void ropeInit(struct rope *r);
+int ropeSize(struct rope *r);
+erow *ropeAt(struct rope *r, int at);
+erow *ropeInsert(struct rope *r, int at);
+void ropeRemove(struct rope *r, erow *row);
+int ropeIndex(erow *row);
+erow *ropeNext(erow *row);
+erow *ropePrev(erow *row);
+void ropeFree(struct rope *r, void (*free_row)(erow *));
+
+// Heights are summed the same way as counts, so screen lines and rows map
+// to each other in O(log n). New rows have a height of 0 until it is set.
+void ropeSetHeight(erow *row, int height);
+void ropeSetHeights(struct rope *r, int (*height)(erow *));
+int ropeHeight(struct rope *r);
+int ropeHeightBefore(erow *row);
+erow *ropeAtHeight(struct rope *r, int line, int *offset);
+
+// Bulk loading: ropeNewSlab hands out n zeroed nodes in one allocation,
+// and once their rows and heights are filled in ropeAppendSlab adds them after the
+// last row in O(n). It returns -1 if it runs out of memory doing so.
+struct ropeNode *ropeNewSlab(struct rope *r, int n);
+int ropeAppendSlab(struct rope *r, struct ropeNode *nodes, int n);
+
+#endif // ROPE_H
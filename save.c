@@ -0,0 +1,191 @@
+#define _DEFAULT_SOURCE
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "save.h"
+
+#define SAVE_IOV_MAX (IOV_MAX < 1024 ? IOV_MAX : 1024)
+
+/*** writing ***/
+
+// writev()s all of iov, a batch at a time. After a short write the
+// entry that was cut off is advanced in place and the rest picked up.
+static ssize_t saveWriteAll(int fd, struct iovec *iov, int iovcnt) {
+  ssize_t total = 0;
+  int i = 0;
+
+  while (i < iovcnt) {
+    int n = iovcnt - i < SAVE_IOV_MAX ? iovcnt - i : SAVE_IOV_MAX;
+    ssize_t written = writev(fd, &iov[i], n);
+    if (written == -1) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    total += written;
+
+    while (i < iovcnt && (size_t)written >= iov[i].iov_len) written -= iov[i++].iov_len;
+    if (i < iovcnt) {
+      iov[i].iov_base = (char *)iov[i].iov_base + written;
+      iov[i].iov_len -= written;
+    }
+  }
+  return total;
+}
+
+// fsync()s the directory the first dirlen bytes of path name, so that a
+// rename into it survives a crash. Filesystems that can't sync a
+// directory say EINVAL, and there is nothing more to do on those.
+static int saveSyncDir(const char *path, int dirlen) {
+  char *dir = dirlen ? strndup(path, dirlen) : strdup(".");
+  if (dir == NULL) return -1;
+  int fd = open(dir, O_RDONLY | O_DIRECTORY);
+  free(dir);
+  if (fd == -1) return -1;
+
+  int ret = fsync(fd) == -1 && errno != EINVAL ? -1 : 0;
+  int saved_errno = errno;
+  close(fd);
+  errno = saved_errno;
+  return ret;
+}
+
+ssize_t saveWrite(const char *path, struct iovec *iov, int iovcnt, struct stat *st) {
+  char *real = realpath(path, NULL);
+  if (real == NULL) real = strdup(path);
+  if (real == NULL) return -1;
+
+  char *slash = strrchr(real, '/');
+  int dirlen = slash ? slash - real + 1 : 0;
+  char *tmp = malloc(strlen(real) + 9);
+  if (tmp == NULL) {
+    free(real);
+    return -1;
+  }
+  sprintf(tmp, "%.*s.%s.XXXXXX", dirlen, real, real + dirlen);
+
+  ssize_t len = -1;
+  int fd = mkstemp(tmp);
+  if (fd != -1) {
+    struct stat old;
+    if (stat(real, &old) == 0) {
+      fchmod(fd, old.st_mode & 07777);
+      if (fchown(fd, old.st_uid, old.st_gid) == -1) {
+        // Not ours to give away; the file ends up owned by us instead.
+      }
+    } else {
+      mode_t mask = umask(0);
+      umask(mask);
+      fchmod(fd, 0644 & ~mask);
+    }
+
+    len = saveWriteAll(fd, iov, iovcnt);
+    if (len != -1 && (fsync(fd) == -1 || fstat(fd, st) == -1)) len = -1;
+    if (close(fd) == -1) len = -1;
+    if (len != -1 && rename(tmp, real) == -1) len = -1;
+    if (len == -1) {
+      int saved_errno = errno;
+      unlink(tmp);
+      errno = saved_errno;
+    } else if (saveSyncDir(real, dirlen) == -1) {
+      // The new file is in place, but might not be after a crash.
+      len = -1;
+    }
+  }
+  free(tmp);
+  free(real);
+  return len;
+}
+
+ssize_t saveWriteAt(const char *path, off_t offset, struct iovec *iov, int iovcnt, struct stat *st) {
+  int fd = open(path, O_WRONLY);
+  if (fd == -1) return -1;
+
+  ssize_t len = -1;
+  if (lseek(fd, offset, SEEK_SET) != -1) len = saveWriteAll(fd, iov, iovcnt);
+  if (len != -1 && ftruncate(fd, offset + len) == -1) len = -1;
+  if (len != -1 && (fsync(fd) == -1 || fstat(fd, st) == -1)) len = -1;
+
+  int saved_errno = errno;
+  close(fd);
+  errno = saved_errno;
+  return len;
+}
+
+/*** writer thread ***/
+
+struct saveJob {
+  char *path;
+  off_t offset;
+  struct iovec *iov;
+  int iovcnt;
+  pthread_t thread;
+  int threaded;
+  pthread_mutex_t lock;
+  int done;
+  ssize_t written;
+  int err;
+  struct stat st;
+};
+
+static void *saveThread(void *arg) {
+  struct saveJob *j = arg;
+  struct stat st;
+  ssize_t written = j->offset == -1 ? saveWrite(j->path, j->iov, j->iovcnt, &st)
+                                    : saveWriteAt(j->path, j->offset, j->iov, j->iovcnt, &st);
+  int err = errno;
+
+  pthread_mutex_lock(&j->lock);
+  j->written = written;
+  j->err = err;
+  j->st = st;
+  j->done = 1;
+  pthread_mutex_unlock(&j->lock);
+  return NULL;
+}
+
+struct saveJob *saveStart(const char *path, off_t offset, struct iovec *iov, int iovcnt) {
+  struct saveJob *j = calloc(1, sizeof(struct saveJob));
+  if (j == NULL) return NULL;
+  j->path = strdup(path);
+  if (j->path == NULL) {
+    free(j);
+    return NULL;
+  }
+  j->offset = offset;
+  j->iov = iov;
+  j->iovcnt = iovcnt;
+  pthread_mutex_init(&j->lock, NULL);
+
+  // Without a thread the save just happens here and now.
+  j->threaded = pthread_create(&j->thread, NULL, saveThread, j) == 0;
+  if (!j->threaded) saveThread(j);
+  return j;
+}
+
+int saveDone(struct saveJob *j) {
+  pthread_mutex_lock(&j->lock);
+  int done = j->done;
+  pthread_mutex_unlock(&j->lock);
+  return done;
+}
+
+ssize_t saveFinish(struct saveJob *j, int *err, struct stat *st) {
+  if (j->threaded) pthread_join(j->thread, NULL);
+  ssize_t written = j->written;
+  *err = j->err;
+  *st = j->st;
+
+  pthread_mutex_destroy(&j->lock);
+  free(j->path);
+  free(j->iov);
+  free(j);
+  return written;
+}
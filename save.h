@@ -0,0 +1,36 @@
+#ifndef SAVE_H
+#define SAVE_H
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/*** saving ***/
+
+// Writes the data in iov to a temporary file next to path, fsyncs it and
+// renames it over path, so a failed save never leaves a half written
+// file behind. Symlinks are followed, and the mode and owner of an
+// existing file are kept. Returns the number of bytes written, or -1
+// with errno set, and on success fills in *st for the new file.
+ssize_t saveWrite(const char *path, struct iovec *iov, int iovcnt, struct stat *st);
+
+// Overwrites path from byte `offset` on with the data in iov and cuts it
+// off after that, leaving everything before offset alone. Faster than
+// saveWrite when only the end of a big file changed, but a crash halfway
+// leaves the file half written.
+ssize_t saveWriteAt(const char *path, off_t offset, struct iovec *iov, int iovcnt, struct stat *st);
+
+// Either of the above on a writer thread: saveWriteAt when offset isn't
+// -1. The job takes over iov, which has to stay untouched, along with
+// everything it points to, until the job is finished. Returns NULL, with
+// iov still the caller's, if the job can't be allocated.
+struct saveJob;
+
+struct saveJob *saveStart(const char *path, off_t offset, struct iovec *iov, int iovcnt);
+int saveDone(struct saveJob *j);
+
+// Waits for the job if it is still running and frees it. Returns what
+// the write returned, with its errno in *err and the file's stat in *st.
+ssize_t saveFinish(struct saveJob *j, int *err, struct stat *st);
+
+#endif // SAVE_H
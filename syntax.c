@@ -1,4 +1,12 @@
-#include <stddef.h>
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 #include "syntax.h"
 
 /*** filetype ***/
@@ -65,28 +73,500 @@ struct editorSyntax HLDB[] = {
     C_HL_extensions,
     C_HL_keywords,
     "//", "/*", "*/",
-    HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS
+    HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS,
+    NULL
   },
   {
     "sh",
     SH_HL_extensions,
     SH_HL_keywords,
     "#", "", "",
-    HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS
+    HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS,
+    NULL
   },
   {
     "python",
     PY_HL_extensions,
     PY_HL_keywords,
     "#", NULL, NULL,
-    HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS
+    HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS,
+    NULL
   },
   {
     "javascript",
     JS_HL_extensions,
     JS_HL_keywords,
     "//", "/*", "*/",
-    HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS
+    HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS,
+    NULL
   },
-  { NULL, NULL, NULL, NULL, NULL, NULL, 0 } // Terminator
+  { NULL, NULL, NULL, NULL, NULL, NULL, 0, NULL } // Terminator
 };
+
+/*** keywords ***/
+
+int is_separator(int c) {
+  return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
+}
+
+// A filetype's keywords as a trie over the characters they use. It is
+// only needed while the lexer table is built from it.
+struct keywordTrie {
+  unsigned char column[256]; // 0 for characters no keyword contains
+  int ncolumns;
+  int nnodes;
+  int *next;                 // nnodes * ncolumns children, 0 for none
+  unsigned char *hl;         // HL_KEYWORD1/2 where a keyword ends
+  int *depth;                // characters from the root
+};
+
+static int trieAddNode(struct keywordTrie *t, int depth) {
+  int n = t->nnodes++;
+  t->next = realloc(t->next, sizeof(int) * t->nnodes * t->ncolumns);
+  t->hl = realloc(t->hl, t->nnodes);
+  t->depth = realloc(t->depth, sizeof(int) * t->nnodes);
+  memset(&t->next[n * t->ncolumns], 0, sizeof(int) * t->ncolumns);
+  t->hl[n] = HL_NORMAL;
+  t->depth[n] = depth;
+  return n;
+}
+
+static struct keywordTrie *trieBuild(char **keywords) {
+  struct keywordTrie *t = calloc(1, sizeof(struct keywordTrie));
+
+  // Column 0 stands for every character that isn't in a keyword.
+  t->ncolumns = 1;
+  for (int j = 0; keywords[j]; j++)
+    for (unsigned char *c = (unsigned char *)keywords[j]; *c; c++)
+      if (t->column[*c] == 0 && *c != '|') t->column[*c] = t->ncolumns++;
+
+  trieAddNode(t, 0);
+  for (int j = 0; keywords[j]; j++) {
+    int klen = strlen(keywords[j]);
+    int kw2 = keywords[j][klen - 1] == '|';
+    if (kw2) klen--;
+
+    int node = 0;
+    for (int i = 0; i < klen; i++) {
+      int *child = &t->next[node * t->ncolumns + t->column[(unsigned char)keywords[j][i]]];
+      if (*child == 0) {
+        int n = trieAddNode(t, i + 1);
+        child = &t->next[node * t->ncolumns + t->column[(unsigned char)keywords[j][i]]];
+        *child = n;
+      }
+      node = *child;
+    }
+    // As with the old linear search, the first listing of a keyword wins.
+    if (node != 0 && t->hl[node] == HL_NORMAL) t->hl[node] = kw2 ? HL_KEYWORD2 : HL_KEYWORD1;
+  }
+  return t;
+}
+
+static void trieFree(struct keywordTrie *t) {
+  if (t == NULL) return;
+  free(t->next);
+  free(t->hl);
+  free(t->depth);
+  free(t);
+}
+
+static int trieChild(struct keywordTrie *t, int node, unsigned char c) {
+  if (t == NULL || t->column[c] == 0) return 0;
+  return t->next[node * t->ncolumns + t->column[c]];
+}
+
+/*** lexer table ***/
+
+// The highlighter is a DFA over classes of bytes. Each transition gives
+// the hl of the byte just read, and when that byte finishes a keyword or
+// a comment delimiter, how many bytes before it to paint over: until
+// then they are shown as whatever they'd be if it didn't. Delimiters are
+// matched as the old strncmp loop did, so long as no keyword contains a
+// quote or a character that starts a delimiter, which holds for every
+// filetype in HLDB.
+
+struct lexEdge {
+  int next;
+  unsigned short back; // bytes before this one to paint back_hl
+  unsigned char hl;
+  unsigned char back_hl;
+};
+
+// Inside comments and strings most bytes leave the state as it is, and
+// only a few can change it: '*' in a C comment, the quote and backslash
+// in a string. Runs up to the next of those are scanned for a vector at
+// a time and filled with one memset.
+#define LEX_STOP_MAX 4
+
+struct lexSkip {
+  int nstop;        // -1 when too many bytes end a run, 0 for none
+  unsigned char hl; // of every byte in a run
+  unsigned char stop[LEX_STOP_MAX];
+};
+
+struct syntaxDfa {
+  unsigned char class[256];
+  int nclasses;
+  int nstates;
+  struct lexEdge *edges; // nstates * nclasses
+  struct lexSkip *skip;  // for each state
+  unsigned char *open;   // state is inside a multi-line comment
+  int start[2];          // outside or inside a multi-line comment
+};
+
+enum { LEX_NORMAL, LEX_WORD, LEX_STRING, LEX_MLCOMMENT, LEX_COMMENT };
+
+struct lexState {
+  int mode;
+  int a; // NORMAL: after a separator (0), other (1) or number (2);
+         // WORD: trie node; STRING: the quote; MLCOMMENT: mce matched
+  int b; // NORMAL and WORD: delimiter matched; STRING: after a backslash
+};
+
+struct lexBuild {
+  struct editorSyntax *syntax;
+  struct keywordTrie *trie;
+  const char *scs, *mcs, *mce;
+  int scs_len, mcs_len, mce_len;
+  int ndelim;            // delimiter states while in normal text
+  int mcs_base;          // the first of them for mcs
+  struct lexState *states;
+  int *ids;              // state number for each possible lexState, or -1
+};
+
+// Delimiter states while in normal text are the proper prefixes of scs
+// and mcs: 0 for none, then the ones of scs, then the ones of mcs.
+static int delimLen(struct lexBuild *lb, int d, const char **s) {
+  if (d < lb->mcs_base) {
+    *s = lb->scs;
+    return d;
+  }
+  *s = lb->mcs;
+  return d - lb->mcs_base + 1;
+}
+
+static int delimState(struct lexBuild *lb, const char *buf, int len) {
+  if (len == 0) return 0;
+  if (len < lb->scs_len && memcmp(buf, lb->scs, len) == 0) return len;
+  if (len < lb->mcs_len && memcmp(buf, lb->mcs, len) == 0) return lb->mcs_base + len - 1;
+  return -1;
+}
+
+static int endsWith(const char *buf, int len, const char *s, int slen) {
+  return slen && len >= slen && memcmp(buf + len - slen, s, slen) == 0;
+}
+
+// Steps the scs/mcs matcher over c. Returns 1 or 2 when that finishes scs
+// or mcs, otherwise 0 with the new state in *d.
+static int delimStep(struct lexBuild *lb, int *d, unsigned char c) {
+  const char *s;
+  int len = delimLen(lb, *d, &s);
+  char buf[len + 1];
+  memcpy(buf, s, len);
+  buf[len++] = c;
+
+  if (endsWith(buf, len, lb->scs, lb->scs_len)) return 1;
+  if (endsWith(buf, len, lb->mcs, lb->mcs_len)) return 2;
+  for (int start = 0; start <= len; start++) {
+    *d = delimState(lb, buf + start, len - start);
+    if (*d != -1) break;
+  }
+  return 0;
+}
+
+// The same for mce inside a multi-line comment, with *k characters of it
+// matched. Returns 1 once it is finished.
+static int mceStep(struct lexBuild *lb, int *k, unsigned char c) {
+  char buf[*k + 1];
+  memcpy(buf, lb->mce, *k);
+  buf[*k] = c;
+  int len = *k + 1;
+
+  if (endsWith(buf, len, lb->mce, lb->mce_len)) return 1;
+  for (int start = 0; start <= len; start++) {
+    *k = len - start;
+    if (*k < lb->mce_len && memcmp(buf + start, lb->mce, *k) == 0) break;
+  }
+  return 0;
+}
+
+static int lexQuote(struct lexBuild *lb, unsigned char c) {
+  return (lb->syntax->flags & HL_HIGHLIGHT_STRINGS) && (c == '"' || c == '\'');
+}
+
+static struct lexState lexMake(int mode, int a, int b) {
+  struct lexState s = { mode, a, b };
+  return s;
+}
+
+// Works out one transition by doing what the highlighter used to do for
+// byte c in state s.
+static struct lexState lexStep(struct lexBuild *lb, struct lexState s,
+                               unsigned char c, struct lexEdge *e) {
+  e->hl = HL_NORMAL;
+  e->back = 0;
+  e->back_hl = HL_NORMAL;
+
+  switch (s.mode) {
+    case LEX_COMMENT:
+      e->hl = HL_COMMENT;
+      return s;
+    case LEX_MLCOMMENT:
+      e->hl = HL_MLCOMMENT;
+      if (mceStep(lb, &s.a, c)) return lexMake(LEX_NORMAL, 0, 0);
+      return s;
+    case LEX_STRING:
+      e->hl = HL_STRING;
+      if (s.b) return lexMake(LEX_STRING, s.a, 0);
+      if (c == '\\') return lexMake(LEX_STRING, s.a, 1);
+      if (c == s.a) return lexMake(LEX_NORMAL, 0, 0);
+      return s;
+  }
+
+  // The highlighter passes isdigit() and friends a plain char.
+  int sep = is_separator((char)c);
+  int d = s.b;
+  int delim = delimStep(lb, &d, c);
+
+  if (s.mode == LEX_WORD && sep && lb->trie->hl[s.a] != HL_NORMAL) {
+    e->back = lb->trie->depth[s.a];
+    e->back_hl = lb->trie->hl[s.a];
+  }
+  if (delim) {
+    int len = delim == 1 ? lb->scs_len : lb->mcs_len;
+    e->hl = delim == 1 ? HL_COMMENT : HL_MLCOMMENT;
+    if (len > 1) {
+      e->back = len - 1;
+      e->back_hl = e->hl;
+    }
+    return delim == 1 ? lexMake(LEX_COMMENT, 0, 0) : lexMake(LEX_MLCOMMENT, 0, 0);
+  }
+
+  int prev_sep = s.mode == LEX_NORMAL && s.a == 0;
+  int prev_number = s.mode == LEX_NORMAL && s.a == 2;
+  if (s.mode == LEX_WORD && !sep && !lexQuote(lb, c)) {
+    int child = trieChild(lb->trie, s.a, c);
+    if (child) return lexMake(LEX_WORD, child, d);
+  }
+
+  if (lexQuote(lb, c)) {
+    e->hl = HL_STRING;
+    return lexMake(LEX_STRING, c, 0);
+  }
+  if ((lb->syntax->flags & HL_HIGHLIGHT_NUMBERS) &&
+      ((isdigit((char)c) && (prev_sep || prev_number)) || (c == '.' && prev_number))) {
+    e->hl = HL_NUMBER;
+    return lexMake(LEX_NORMAL, 2, d);
+  }
+  if (prev_sep && !sep) {
+    int child = trieChild(lb->trie, 0, c);
+    if (child) return lexMake(LEX_WORD, child, d);
+  }
+  return lexMake(LEX_NORMAL, sep ? 0 : 1, d);
+}
+
+// Where a state's number is kept in lb->ids.
+static int lexSlot(struct lexBuild *lb, struct lexState s) {
+  int nnodes = lb->trie ? lb->trie->nnodes : 1;
+  int slot = 0;
+  if (s.mode == LEX_NORMAL) return s.a * lb->ndelim + s.b;
+  slot += 3 * lb->ndelim;
+  if (s.mode == LEX_WORD) return slot + s.a * lb->ndelim + s.b;
+  slot += nnodes * lb->ndelim;
+  if (s.mode == LEX_STRING) return slot + s.a * 2 + s.b;
+  slot += 256 * 2;
+  if (s.mode == LEX_MLCOMMENT) return slot + s.a;
+  return slot + lb->mce_len + 1;
+}
+
+static int lexStateId(struct lexBuild *lb, struct syntaxDfa *dfa, struct lexState s) {
+  int *id = &lb->ids[lexSlot(lb, s)];
+  if (*id != -1) return *id;
+
+  *id = dfa->nstates++;
+  lb->states = realloc(lb->states, sizeof(struct lexState) * dfa->nstates);
+  lb->states[*id] = s;
+  dfa->open = realloc(dfa->open, dfa->nstates);
+  dfa->open[*id] = s.mode == LEX_MLCOMMENT;
+  return *id;
+}
+
+// A state can be skipped through if reading any byte but a few stop
+// bytes leaves it where it is without painting anything back.
+static void lexFindSkips(struct syntaxDfa *dfa) {
+  dfa->skip = malloc(sizeof(struct lexSkip) * dfa->nstates);
+  for (int id = 0; id < dfa->nstates; id++) {
+    struct lexSkip *skip = &dfa->skip[id];
+    struct lexEdge *edges = &dfa->edges[id * dfa->nclasses];
+    skip->nstop = 0;
+    skip->hl = HL_NORMAL;
+    int loops = 0;
+    for (int k = 0; k < dfa->nclasses; k++) {
+      if (edges[k].next == id && edges[k].back == 0 && (loops == 0 || edges[k].hl == skip->hl)) {
+        skip->hl = edges[k].hl;
+        loops = 1;
+      }
+    }
+    for (int c = 0; c < 256 && skip->nstop != -1; c++) {
+      struct lexEdge *e = &edges[dfa->class[c]];
+      if (e->next == id && e->back == 0 && e->hl == skip->hl) continue;
+      if (skip->nstop == LEX_STOP_MAX) skip->nstop = -1;
+      else skip->stop[skip->nstop++] = c;
+    }
+    if (!loops) skip->nstop = -1;
+    // Unused slots repeat a stop byte, so the vector loops can always
+    // compare against all of them.
+    for (int j = skip->nstop; j > 0 && j < LEX_STOP_MAX; j++) skip->stop[j] = skip->stop[0];
+  }
+}
+
+static struct syntaxDfa *lexBuildDfa(struct editorSyntax *syntax, struct keywordTrie *trie) {
+  struct lexBuild lb = { 0 };
+  lb.syntax = syntax;
+  lb.trie = trie;
+  lb.scs = syntax->singleline_comment_start ? syntax->singleline_comment_start : "";
+  lb.mcs = syntax->multiline_comment_start ? syntax->multiline_comment_start : "";
+  lb.mce = syntax->multiline_comment_end ? syntax->multiline_comment_end : "";
+  lb.scs_len = strlen(lb.scs);
+  lb.mcs_len = strlen(lb.mcs);
+  lb.mce_len = strlen(lb.mce);
+  if (lb.mcs_len == 0 || lb.mce_len == 0) lb.mcs_len = lb.mce_len = 0;
+  lb.mcs_base = lb.scs_len ? lb.scs_len : 1;
+  lb.ndelim = lb.mcs_base + (lb.mcs_len ? lb.mcs_len - 1 : 0);
+
+  struct syntaxDfa *dfa = calloc(1, sizeof(struct syntaxDfa));
+
+  // Bytes the highlighter can't tell apart share a class.
+  int sig[256][3];
+  unsigned char rep[256];
+  for (int c = 0; c < 256; c++) {
+    int delim = strchr(lb.scs, c) || strchr(lb.mcs, c) || strchr(lb.mce, c);
+    sig[c][0] = (is_separator((char)c) != 0) | (isdigit((char)c) != 0) << 1 |
+                (c == '.') << 2 | (c == '\\') << 3;
+    sig[c][1] = trie ? trie->column[c] : 0;
+    sig[c][2] = lexQuote(&lb, c) || (c != 0 && delim) ? c : -1;
+    int k = 0;
+    while (k < dfa->nclasses && memcmp(sig[rep[k]], sig[c], sizeof(int) * 3) != 0) k++;
+    if (k == dfa->nclasses) rep[dfa->nclasses++] = c;
+    dfa->class[c] = k;
+  }
+
+  int nnodes = trie ? trie->nnodes : 1;
+  int nslots = (3 + nnodes) * lb.ndelim + 256 * 2 + lb.mce_len + 2;
+  lb.ids = malloc(sizeof(int) * nslots);
+  for (int i = 0; i < nslots; i++) lb.ids[i] = -1;
+
+  dfa->start[0] = lexStateId(&lb, dfa, lexMake(LEX_NORMAL, 0, 0));
+  dfa->start[1] = lb.mcs_len ? lexStateId(&lb, dfa, lexMake(LEX_MLCOMMENT, 0, 0)) : dfa->start[0];
+
+  // States are numbered as they are first reached, so this goes on until
+  // every reachable one has its row of the table.
+  for (int id = 0; id < dfa->nstates; id++) {
+    dfa->edges = realloc(dfa->edges, sizeof(struct lexEdge) * dfa->nstates * dfa->nclasses);
+    for (int k = 0; k < dfa->nclasses; k++) {
+      struct lexEdge *e = &dfa->edges[id * dfa->nclasses + k];
+      struct lexState next = lexStep(&lb, lb.states[id], rep[k], e);
+      e->next = lexStateId(&lb, dfa, next);
+    }
+  }
+  dfa->edges = realloc(dfa->edges, sizeof(struct lexEdge) * dfa->nstates * dfa->nclasses);
+  lexFindSkips(dfa);
+
+  free(lb.states);
+  free(lb.ids);
+  return dfa;
+}
+
+void syntaxCompile(struct editorSyntax *s) {
+  if (s->dfa) return;
+  struct keywordTrie *trie = s->keywords ? trieBuild(s->keywords) : NULL;
+  s->dfa = lexBuildDfa(s, trie);
+  trieFree(trie);
+}
+
+/*** highlighting ***/
+
+// Returns where the first of the skip's stop bytes is from i on, or len.
+static int lexSkipRun(const unsigned char *p, int i, int len, struct lexSkip *skip) {
+  if (skip->nstop == 0) return len;
+  const unsigned char *stop = skip->stop;
+#ifdef __AVX2__
+  __m256i w0 = _mm256_set1_epi8(stop[0]), w1 = _mm256_set1_epi8(stop[1]);
+  __m256i w2 = _mm256_set1_epi8(stop[2]), w3 = _mm256_set1_epi8(stop[3]);
+  for (; i + 32 <= len; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+    __m256i m = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, w0), _mm256_cmpeq_epi8(v, w1)),
+                                _mm256_or_si256(_mm256_cmpeq_epi8(v, w2), _mm256_cmpeq_epi8(v, w3)));
+    unsigned int mask = _mm256_movemask_epi8(m);
+    if (mask) return i + __builtin_ctz(mask);
+  }
+#endif
+#ifdef __SSE2__
+  __m128i s0 = _mm_set1_epi8(stop[0]), s1 = _mm_set1_epi8(stop[1]);
+  __m128i s2 = _mm_set1_epi8(stop[2]), s3 = _mm_set1_epi8(stop[3]);
+  for (; i + 16 <= len; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+    __m128i m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, s0), _mm_cmpeq_epi8(v, s1)),
+                             _mm_or_si128(_mm_cmpeq_epi8(v, s2), _mm_cmpeq_epi8(v, s3)));
+    unsigned int mask = _mm_movemask_epi8(m);
+    if (mask) return i + __builtin_ctz(mask);
+  }
+#endif
+  for (; i < len; i++)
+    if (p[i] == stop[0] || p[i] == stop[1] || p[i] == stop[2] || p[i] == stop[3]) break;
+  return i;
+}
+
+int syntaxHighlight(struct editorSyntax *syntax, const char *render, int rsize,
+                    int in_comment, unsigned char *hl) {
+  if (syntax == NULL || syntax->dfa == NULL) {
+    memset(hl, HL_NORMAL, rsize);
+    return in_comment;
+  }
+
+  struct syntaxDfa *dfa = syntax->dfa;
+  const unsigned char *p = (const unsigned char *)render;
+  int state = dfa->start[in_comment != 0];
+  for (int i = 0; i < rsize; i++) {
+    struct lexSkip *skip = &dfa->skip[state];
+    if (skip->nstop != -1) {
+      int end = lexSkipRun(p, i, rsize, skip);
+      memset(&hl[i], skip->hl, end - i);
+      i = end;
+      if (i == rsize) break;
+    }
+    struct lexEdge *e = &dfa->edges[state * dfa->nclasses + dfa->class[p[i]]];
+    hl[i] = e->hl;
+    if (e->back) memset(&hl[i - e->back], e->back_hl, e->back);
+    state = e->next;
+  }
+
+  // A keyword can end the line as well as at a separator.
+  struct lexEdge *e = &dfa->edges[state * dfa->nclasses + dfa->class[0]];
+  if (e->back) memset(&hl[rsize - e->back], e->back_hl, e->back);
+  return dfa->open[state];
+}
+
+hlSpan *syntaxSpans(const unsigned char *hl, int len, int *nspans) {
+  while (len > 0 && hl[len - 1] == HL_NORMAL) len--;
+
+  int n = 0;
+  for (int i = 0; i < len; n++) {
+    int run = 1;
+    while (i + run < len && hl[i + run] == hl[i] && run < HL_SPAN_MAX) run++;
+    i += run;
+  }
+
+  *nspans = n;
+  if (n == 0) return NULL;
+  hlSpan *spans = malloc(sizeof(hlSpan) * n);
+  n = 0;
+  for (int i = 0; i < len; n++) {
+    int run = 1;
+    while (i + run < len && hl[i + run] == hl[i] && run < HL_SPAN_MAX) run++;
+    spans[n].len = run;
+    spans[n].hl = hl[i];
+    i += run;
+  }
+  return spans;
+}
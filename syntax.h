@@ -1,6 +1,8 @@
 #ifndef SYNTAX_H
 #define SYNTAX_H
 
+#include <stddef.h>
+
 enum editorHighlight {
   HL_NORMAL = 0,
   HL_COMMENT,
@@ -18,6 +20,8 @@ enum editorHighlight {
 
 /*** data ***/
 
+struct syntaxDfa;
+
 struct editorSyntax {
   char *filetype;
   char **filematch;
@@ -26,10 +30,42 @@ struct editorSyntax {
   char *multiline_comment_start;
   char *multiline_comment_end;
   int flags;
+  struct syntaxDfa *dfa; // lexer table, built when first selected
 };
 
 /*** filetypes ***/
 
 extern struct editorSyntax HLDB[];
 
+/*** keywords ***/
+
+int is_separator(int c);
+
+// Compiles s into the table syntaxHighlight runs on, unless that has
+// been done already.
+void syntaxCompile(struct editorSyntax *s);
+
+/*** highlighting ***/
+
+// A run of cells with the same highlight. A row's spans follow each
+// other from its first cell, and cells after the last one are
+// HL_NORMAL. Longer runs are split.
+typedef struct hlSpan {
+  unsigned short len;
+  unsigned char hl;
+} hlSpan;
+
+#define HL_SPAN_MAX 65535
+
+// Fills hl with the highlight of each of the rsize bytes of render.
+// in_comment says whether the line starts inside a multi-line comment;
+// the return value says whether it ends in one. Only reads syntax, so it
+// is safe to call from any thread once the syntax is compiled.
+int syntaxHighlight(struct editorSyntax *syntax, const char *render, int rsize,
+                    int in_comment, unsigned char *hl);
+
+// Packs the len bytes of hl into spans, storing how many in *nspans.
+// Returns NULL when every byte is HL_NORMAL.
+hlSpan *syntaxSpans(const unsigned char *hl, int len, int *nspans);
+
 #endif // SYNTAX_H
@@ -0,0 +1,675 @@
+#define _DEFAULT_SOURCE
+#define _XOPEN_SOURCE 700
+
+#include <errno.h>
+#include <fcntl.h>
+#include <langinfo.h>
+#include <locale.h>
+#include <ncurses.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+#include <unistd.h>
+#include <wchar.h>
+#include "term.h"
+
+#define TERM_ESC_WAIT 50 // ms to wait for the rest of an escape sequence
+#define TERM_SKIP_MAX 6  // unchanged cells rewritten rather than moved over
+
+// Bracketed paste: the terminal wraps pasted text in ESC[200~ and ESC[201~.
+#define TERM_PASTE_ON "\x1b[?2004h"
+#define TERM_PASTE_OFF "\x1b[?2004l"
+
+/*** append buffer ***/
+
+struct abuf {
+  char *b;
+  int len;
+  int cap;
+};
+
+#define ABUF_INIT {NULL, 0, 0}
+
+static void abAppend(struct abuf *ab, const char *s, int len) {
+  if (ab->len + len > ab->cap) {
+    int cap = ab->cap ? ab->cap * 2 : 4096;
+    while (cap < ab->len + len) cap *= 2;
+    char *new = realloc(ab->b, cap);
+    if (new == NULL) return;
+    ab->b = new;
+    ab->cap = cap;
+  }
+  memcpy(&ab->b[ab->len], s, len);
+  ab->len += len;
+}
+
+static void abFree(struct abuf *ab) {
+  free(ab->b);
+}
+
+/*** state ***/
+
+// A cell holds one character as its UTF-8 bytes, padded with NULs. The
+// cell to the right of a double-width character has none at all.
+struct termCell {
+  unsigned char c[4];
+  unsigned short attr;
+};
+
+static int termVt; // using the VT backend rather than ncurses
+static struct termios termOrig;
+static int termRows, termCols;
+static struct termCell *termFront; // what the terminal shows
+static struct termCell *termBack;  // what it should show after termRefresh
+static int termFull;               // the terminal has to be cleared first
+static int termY, termX;           // where the next cell is put
+static int termAttr;
+static int termPairs[TERM_PAIR_MASK + 1][2];
+static int termWait = -1;
+static int termWinch[2] = {-1, -1}; // SIGWINCH writes here to wake up poll
+static int termUtf8;               // the terminal takes UTF-8
+
+// A UTF-8 character being put a byte at a time, one column per byte.
+static unsigned char termSeq[4];
+static int termSeqLen, termSeqNeed;
+static int termSeqY, termSeqX = -1; // where it started, if one is
+static int termSeqAttr;
+
+/*** setup ***/
+
+static void termOnWinch(int sig) {
+  (void)sig;
+  int saved = errno;
+  if (write(termWinch[1], "", 1)) {}
+  errno = saved;
+}
+
+static void termSetBlank(struct termCell *cell, int attr) {
+  memset(cell->c, 0, sizeof(cell->c));
+  cell->c[0] = ' ';
+  cell->attr = attr;
+}
+
+static void termResize() {
+  struct winsize ws;
+  termRows = 24;
+  termCols = 80;
+  if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) != -1 && ws.ws_col != 0) {
+    termRows = ws.ws_row;
+    termCols = ws.ws_col;
+  }
+
+  int cells = termRows * termCols;
+  free(termFront);
+  free(termBack);
+  termFront = malloc(sizeof(struct termCell) * (cells ? cells : 1));
+  termBack = malloc(sizeof(struct termCell) * (cells ? cells : 1));
+  for (int i = 0; i < cells; i++) termSetBlank(&termBack[i], 0);
+  termFull = 1;
+}
+
+void termInit(int vt) {
+  termVt = vt;
+  if (!vt) {
+    initscr();               // Start ncurses mode
+    raw();                   // Go into raw mode (character-at-a-time)
+    nonl();                  // Carriage returns come in as themselves
+    noecho();                // Don't echo characters as they are typed
+    keypad(stdscr, TRUE);    // Enable F-keys, arrow keys, etc
+    start_color();           // Enable color support
+    fputs(TERM_PASTE_ON, stdout);
+    fflush(stdout);
+    return;
+  }
+
+  if (tcgetattr(STDIN_FILENO, &termOrig) == -1) {
+    perror("tcgetattr");
+    exit(1);
+  }
+  // Like ncurses' raw() and nonl(), so carriage returns come in as
+  // themselves.
+  struct termios raw = termOrig;
+  raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+  raw.c_oflag &= ~(OPOST);
+  raw.c_cflag |= (CS8);
+  raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+  raw.c_cc[VMIN] = 1;
+  raw.c_cc[VTIME] = 0;
+  if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) {
+    perror("tcsetattr");
+    exit(1);
+  }
+
+  if (pipe(termWinch) == 0) {
+    fcntl(termWinch[0], F_SETFL, O_NONBLOCK);
+    fcntl(termWinch[1], F_SETFL, O_NONBLOCK);
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = termOnWinch;
+    sigaction(SIGWINCH, &sa, NULL);
+  }
+
+  // Only LC_CTYPE, to tell whether the terminal speaks UTF-8 and how wide
+  // its characters are.
+  setlocale(LC_CTYPE, "");
+  termUtf8 = strcmp(nl_langinfo(CODESET), "UTF-8") == 0;
+
+  termResize();
+  // The alternate screen, so the shell's screen comes back afterwards.
+  if (write(STDOUT_FILENO, "\x1b[?1049h" TERM_PASTE_ON, 16)) {}
+}
+
+void termEnd() {
+  if (!termVt) {
+    endwin();   // Cleanly exit ncurses mode
+    fputs(TERM_PASTE_OFF, stdout);
+    fflush(stdout);
+    return;
+  }
+  if (write(STDOUT_FILENO, TERM_PASTE_OFF "\x1b[m\x1b[?25h\x1b[?1049l", 25)) {}
+  tcsetattr(STDIN_FILENO, TCSAFLUSH, &termOrig);
+}
+
+void termSize(int *rows, int *cols) {
+  if (!termVt) {
+    getmaxyx(stdscr, *rows, *cols);
+    return;
+  }
+  *rows = termRows;
+  *cols = termCols;
+}
+
+void termInitPair(int pair, int fg, int bg) {
+  if (!termVt) {
+    init_pair(pair, fg, bg);
+    return;
+  }
+  termPairs[pair & TERM_PAIR_MASK][0] = fg;
+  termPairs[pair & TERM_PAIR_MASK][1] = bg;
+}
+
+/*** output ***/
+
+static int termCursesAttr(int attr) {
+  return COLOR_PAIR(attr & TERM_PAIR_MASK) | ((attr & TERM_DIM) ? A_DIM : 0) |
+         ((attr & TERM_REVERSE) ? A_REVERSE : 0);
+}
+
+// Like ncurses, turning a colour pair on replaces the one in use, and
+// turning any pair off goes back to the default colours.
+void termAttrOn(int attr) {
+  if (!termVt) {
+    attron(termCursesAttr(attr));
+    return;
+  }
+  if (attr & TERM_PAIR_MASK) termAttr &= ~TERM_PAIR_MASK;
+  termAttr |= attr;
+}
+
+void termAttrOff(int attr) {
+  if (!termVt) {
+    attroff(termCursesAttr(attr));
+    return;
+  }
+  if (attr & TERM_PAIR_MASK) termAttr &= ~TERM_PAIR_MASK;
+  termAttr &= ~(attr & ~TERM_PAIR_MASK);
+}
+
+void termMove(int y, int x) {
+  if (!termVt) {
+    move(y, x);
+    return;
+  }
+  termY = y;
+  termX = x;
+}
+
+// Sets the cell under the cursor, first blanking the other half of any
+// double-width character it was part of.
+static void termSetCell(const unsigned char *c, int len, int attr) {
+  if (termY >= 0 && termY < termRows && termX >= 0 && termX < termCols) {
+    struct termCell *cell = &termBack[termY * termCols + termX];
+    if (cell->c[0] == 0 && termX > 0) termSetBlank(cell - 1, cell[-1].attr);
+    if (termX + 1 < termCols && cell[1].c[0] == 0) termSetBlank(cell + 1, cell[1].attr);
+    memset(cell->c, 0, sizeof(cell->c));
+    memcpy(cell->c, c, len);
+    cell->attr = attr;
+  }
+  termX++;
+}
+
+static void termPut(int c) {
+  unsigned char b = c;
+  termSetCell(&b, 1, termAttr);
+}
+
+// Control characters are shown as ^X and other bytes past ASCII as M-x,
+// the way ncurses' unctrl() shows them.
+static void termPutEscaped(unsigned char c) {
+  if (c >= 128) {
+    termPut('M');
+    termPut('-');
+    c &= 127;
+  }
+  if (c < 32) {
+    termPut('^');
+    termPut(c + 64);
+  } else if (c == 127) {
+    termPut('^');
+    termPut('?');
+  } else {
+    termPut(c);
+  }
+}
+
+// Gives up on the UTF-8 character being put, showing its bytes escaped in
+// the columns they were put in.
+static void termSeqAbandon() {
+  int y = termY, x = termX, attr = termAttr;
+  termY = termSeqY;
+  termAttr = termSeqAttr;
+  for (int i = 0; i < termSeqLen; i++) {
+    termX = termSeqX + i;
+    termPutEscaped(termSeq[i]);
+  }
+  termSeqX = -1;
+  termY = y;
+  termX = x;
+  termAttr = attr;
+}
+
+// Puts the finished UTF-8 character in the first of its columns and
+// blanks the rest, so the terminal and the cells stay in step however
+// wide it turns out to be.
+static void termSeqEnd() {
+  static const int min[] = {0, 0, 0x80, 0x800, 0x10000};
+  int cp = termSeq[0] & (0x7f >> termSeqLen);
+  for (int i = 1; i < termSeqLen; i++) cp = (cp << 6) | (termSeq[i] & 0x3f);
+  int width = -1;
+  if (cp >= min[termSeqLen] && cp <= 0x10ffff && (cp < 0xd800 || cp > 0xdfff))
+    width = wcwidth(cp);
+  if (width < 1 || width > termSeqLen || (width == 2 && termSeqX + 1 >= termCols)) {
+    termSeqAbandon();
+    return;
+  }
+
+  int y = termY, x = termX, attr = termAttr;
+  termY = termSeqY;
+  termX = termSeqX;
+  termAttr = termSeqAttr;
+  termSetCell(termSeq, termSeqLen, termSeqAttr);
+  for (int i = 1; i < termSeqLen; i++) {
+    if (i < width) {
+      static const unsigned char none[1] = {0};
+      termSetCell(none, 0, termSeqAttr);
+    } else {
+      termPut(' ');
+    }
+  }
+  termSeqX = -1;
+  termY = y;
+  termX = x;
+  termAttr = attr;
+}
+
+// UTF-8 characters come a byte at a time, each in the column after the
+// last. Anything that breaks one off, or any other byte past ASCII when
+// the terminal doesn't take UTF-8, is shown escaped.
+static void termPutByte(unsigned char c) {
+  if (termSeqX >= 0) {
+    if ((c & 0xc0) == 0x80 && termY == termSeqY && termX == termSeqX + termSeqLen) {
+      termSeq[termSeqLen++] = c;
+      termX++;
+      if (termSeqLen == termSeqNeed) termSeqEnd();
+      return;
+    }
+    termSeqAbandon();
+  }
+  if (termUtf8 && c >= 0xc2 && c <= 0xf4) {
+    termSeq[0] = c;
+    termSeqLen = 1;
+    termSeqNeed = c >= 0xf0 ? 4 : c >= 0xe0 ? 3 : 2;
+    termSeqY = termY;
+    termSeqX = termX;
+    termSeqAttr = termAttr;
+    termX++;
+    return;
+  }
+  termPutEscaped(c);
+}
+
+void termPutText(int y, int x, const char *s, int len) {
+  if (!termVt) {
+    mvaddnstr(y, x, s, len);
+    return;
+  }
+  termMove(y, x);
+  for (int i = 0; i < len && s[i] != '\0'; i++) termPutByte(s[i]);
+}
+
+void termPutChar(int y, int x, int c) {
+  if (!termVt) {
+    mvaddch(y, x, c);
+    return;
+  }
+  termMove(y, x);
+  termPutByte(c);
+}
+
+void termPrintf(int y, int x, const char *fmt, ...) {
+  char buf[1024];
+  va_list ap;
+  va_start(ap, fmt);
+  int len = vsnprintf(buf, sizeof(buf), fmt, ap);
+  va_end(ap);
+  if (len < 0) return;
+  if (len >= (int)sizeof(buf)) len = sizeof(buf) - 1;
+  if (!termVt) {
+    mvaddnstr(y, x, buf, len);
+    return;
+  }
+  termPutText(y, x, buf, len);
+}
+
+void termClearToEol() {
+  if (!termVt) {
+    clrtoeol();
+    return;
+  }
+  if (termSeqX >= 0) termSeqAbandon();
+  if (termY < 0 || termY >= termRows) return;
+  int x = termX < 0 ? 0 : termX;
+  if (x > 0 && x < termCols && termBack[termY * termCols + x].c[0] == 0)
+    termSetBlank(&termBack[termY * termCols + x - 1], termBack[termY * termCols + x - 1].attr);
+  for (; x < termCols; x++) termSetBlank(&termBack[termY * termCols + x], 0);
+}
+
+// Switches the terminal from attributes `from` to `to`, -1 being unknown,
+// sending only what changes.
+static void termSgr(struct abuf *ab, int from, int to) {
+  char buf[32];
+  int len = snprintf(buf, sizeof(buf), "\x1b[");
+  int on = TERM_DIM | TERM_REVERSE;
+  if (from < 0 || (from & ~to & on) || ((from & TERM_PAIR_MASK) && !(to & TERM_PAIR_MASK))) {
+    len += snprintf(buf + len, sizeof(buf) - len, "0;");
+    from = 0;
+  }
+  if ((to & TERM_DIM) && !(from & TERM_DIM)) len += snprintf(buf + len, sizeof(buf) - len, "2;");
+  if ((to & TERM_REVERSE) && !(from & TERM_REVERSE))
+    len += snprintf(buf + len, sizeof(buf) - len, "7;");
+  int fp = from & TERM_PAIR_MASK, tp = to & TERM_PAIR_MASK;
+  if (tp && (!fp || termPairs[fp][0] != termPairs[tp][0]))
+    len += snprintf(buf + len, sizeof(buf) - len, "%d;", 30 + termPairs[tp][0]);
+  if (tp && (!fp || termPairs[fp][1] != termPairs[tp][1]))
+    len += snprintf(buf + len, sizeof(buf) - len, "%d;", 40 + termPairs[tp][1]);
+  if (len == 2) return;
+  buf[len - 1] = 'm';
+  abAppend(ab, buf, len);
+}
+
+static void termWriteAll(const char *s, int len) {
+  while (len > 0) {
+    ssize_t n = write(STDOUT_FILENO, s, len);
+    if (n == -1 && errno == EINTR) continue;
+    if (n <= 0) return;
+    s += n;
+    len -= n;
+  }
+}
+
+static int termCellSame(const struct termCell *a, const struct termCell *b) {
+  return memcmp(a->c, b->c, sizeof(a->c)) == 0 && a->attr == b->attr;
+}
+
+static int termCellLen(const struct termCell *cell) {
+  int len = 0;
+  while (len < (int)sizeof(cell->c) && cell->c[len] != 0) len++;
+  return len;
+}
+
+// Sends the cells that differ from what the terminal shows. Short runs of
+// unchanged cells in between are sent again when that is shorter than
+// moving the cursor over them, and a row that ends in blanks is finished
+// with an erase to end of line.
+void termRefresh() {
+  if (!termVt) {
+    refresh();
+    return;
+  }
+
+  if (termSeqX >= 0) termSeqAbandon();
+
+  struct abuf ab = ABUF_INIT;
+  char buf[32];
+  abAppend(&ab, "\x1b[?25l", 6);
+  if (termFull) {
+    abAppend(&ab, "\x1b[m\x1b[H\x1b[2J", 10);
+    for (int i = 0; i < termRows * termCols; i++) termSetBlank(&termFront[i], 0);
+    termFull = 0;
+  }
+
+  int attr = -1;
+  for (int y = 0; y < termRows; y++) {
+    struct termCell *back = &termBack[y * termCols];
+    struct termCell *front = &termFront[y * termCols];
+    int cx = -1; // where the cursor is on this row, if known
+    int end = termCols; // blanks from here on
+    while (end > 0 && back[end - 1].c[0] == ' ' && back[end - 1].c[1] == 0 &&
+           back[end - 1].attr == 0)
+      end--;
+    for (int x = 0; x < termCols; x++) {
+      if (termCellSame(&back[x], &front[x])) continue;
+      // The right half of a double-width character is sent with its left.
+      if (back[x].c[0] == 0 && x > 0) x--;
+
+      if (x >= end) {
+        if (cx != x) {
+          int len = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y + 1, x + 1);
+          abAppend(&ab, buf, len);
+        }
+        if (attr != 0) termSgr(&ab, attr, 0);
+        attr = 0;
+        abAppend(&ab, "\x1b[K", 3);
+        for (; x < termCols; x++) front[x] = back[x];
+        break;
+      }
+
+      if (cx != x) {
+        int skip = cx >= 0 && x - cx <= TERM_SKIP_MAX;
+        for (int k = cx; skip && k < x; k++) skip = back[k].attr == attr && back[k].c[0] != 0;
+        if (skip) {
+          for (int k = cx; k < x; k++) abAppend(&ab, (char *)back[k].c, termCellLen(&back[k]));
+        } else {
+          int len = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y + 1, x + 1);
+          abAppend(&ab, buf, len);
+        }
+      }
+      if (back[x].attr != attr) {
+        termSgr(&ab, attr, back[x].attr);
+        attr = back[x].attr;
+      }
+      abAppend(&ab, (char *)back[x].c, termCellLen(&back[x]));
+      front[x] = back[x];
+      if (x + 1 < termCols && back[x + 1].c[0] == 0) {
+        x++;
+        front[x] = back[x];
+      }
+      cx = x + 1;
+    }
+  }
+
+  int y = termY < termRows ? termY : termRows - 1;
+  int x = termX < termCols ? termX : termCols - 1;
+  int len = snprintf(buf, sizeof(buf), "\x1b[%d;%dH\x1b[?25h", y + 1, x + 1);
+  abAppend(&ab, buf, len);
+  termWriteAll(ab.b, ab.len);
+  abFree(&ab);
+}
+
+/*** input ***/
+
+void termTimeout(int ms) {
+  if (!termVt) timeout(ms);
+  termWait = ms;
+}
+
+static int termCursesKey(int key) {
+  switch (key) {
+    case ERR: return TERM_KEY_NONE;
+    case KEY_RESIZE: return TERM_KEY_RESIZE;
+    case KEY_UP: return TERM_KEY_UP;
+    case KEY_DOWN: return TERM_KEY_DOWN;
+    case KEY_LEFT: return TERM_KEY_LEFT;
+    case KEY_RIGHT: return TERM_KEY_RIGHT;
+    case KEY_PPAGE: return TERM_KEY_PAGE_UP;
+    case KEY_NPAGE: return TERM_KEY_PAGE_DOWN;
+    case KEY_HOME: return TERM_KEY_HOME;
+    case KEY_END: return TERM_KEY_END;
+    case KEY_DC: return TERM_KEY_DELETE;
+    case KEY_BACKSPACE: return TERM_KEY_BACKSPACE;
+    case KEY_ENTER: return TERM_KEY_ENTER;
+    default: return key;
+  }
+}
+
+// Bytes read from the terminal but not yet handed out. A burst of input,
+// like a paste, is then read in a few big reads rather than byte by byte.
+static unsigned char termIn[4096];
+static int termInPos, termInLen;
+
+// Reads a byte if one comes within `wait` ms.
+static int termReadByte(int wait, unsigned char *c) {
+  if (termInPos == termInLen) {
+    struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+    if (poll(&pfd, 1, wait) <= 0) return 0;
+    ssize_t n = read(STDIN_FILENO, termIn, sizeof(termIn));
+    if (n <= 0) return 0;
+    termInPos = 0;
+    termInLen = n;
+  }
+  *c = termIn[termInPos++];
+  return 1;
+}
+
+static int termTildeKey(int n) {
+  switch (n) {
+    case 1:
+    case 7: return TERM_KEY_HOME;
+    case 3: return TERM_KEY_DELETE;
+    case 4:
+    case 8: return TERM_KEY_END;
+    case 5: return TERM_KEY_PAGE_UP;
+    case 6: return TERM_KEY_PAGE_DOWN;
+    case 200: return TERM_KEY_PASTE_START;
+    case 201: return TERM_KEY_PASTE_END;
+  }
+  return '\x1b';
+}
+
+// Turns the rest of an escape sequence into a key. A lone ESC, or one
+// followed by something we don't know, comes back as ESC. The byte that
+// showed the sequence wasn't one of ours is put back to be read as a key:
+// it may be the ESC of the next sequence, such as the end of a paste.
+static int termReadEscape() {
+  unsigned char seq[3];
+  if (!termReadByte(TERM_ESC_WAIT, &seq[0])) return '\x1b';
+  if (seq[0] != '[' && seq[0] != 'O') {
+    termInPos--;
+    return '\x1b';
+  }
+  if (!termReadByte(TERM_ESC_WAIT, &seq[1])) return '\x1b';
+
+  if (seq[0] == '[' && seq[1] >= '0' && seq[1] <= '9') {
+    int n = seq[1] - '0';
+    int got;
+    while ((got = termReadByte(TERM_ESC_WAIT, &seq[2])) &&
+           seq[2] >= '0' && seq[2] <= '9' && n < 1000)
+      n = n * 10 + seq[2] - '0';
+    if (!got) return '\x1b';
+    if (seq[2] != '~') {
+      termInPos--;
+      return '\x1b';
+    }
+    return termTildeKey(n);
+  }
+
+  switch (seq[1]) {
+    case 'A': return TERM_KEY_UP;
+    case 'B': return TERM_KEY_DOWN;
+    case 'C': return TERM_KEY_RIGHT;
+    case 'D': return TERM_KEY_LEFT;
+    case 'H': return TERM_KEY_HOME;
+    case 'F': return TERM_KEY_END;
+    case 'M': return TERM_KEY_ENTER;
+  }
+  termInPos--;
+  return '\x1b';
+}
+
+// ncurses doesn't know the paste brackets, so they come in as an ESC and
+// the bytes after it. Anything else read here is handed back to ncurses.
+static int termCursesEscape() {
+  static const char *paste = "[20";
+  int got[5];
+  int n = 0;
+  int key = '\x1b';
+
+  timeout(TERM_ESC_WAIT);
+  while (n < 5) {
+    int c = getch();
+    if (c == ERR) break;
+    got[n++] = c;
+    if (n <= 3 && c != paste[n - 1]) break;
+    if (n == 4 && c != '0' && c != '1') break;
+    if (n == 5 && c == '~') key = got[3] == '0' ? TERM_KEY_PASTE_START : TERM_KEY_PASTE_END;
+  }
+  timeout(termWait);
+
+  if (key == '\x1b')
+    while (n > 0) ungetch(got[--n]);
+  return key;
+}
+
+int termGetKey() {
+  if (!termVt) {
+    int key = getch();
+    if (key == '\x1b') return termCursesEscape();
+    return termCursesKey(key);
+  }
+
+  if (termInPos == termInLen) {
+    struct pollfd pfd[2] = {{STDIN_FILENO, POLLIN, 0}, {termWinch[0], POLLIN, 0}};
+    if (poll(pfd, termWinch[0] == -1 ? 1 : 2, termWait) <= 0) return TERM_KEY_NONE;
+
+    if (pfd[1].revents & POLLIN) {
+      char drain[64];
+      while (read(termWinch[0], drain, sizeof(drain)) > 0) {}
+      termResize();
+      return TERM_KEY_RESIZE;
+    }
+  }
+
+  unsigned char c;
+  if (!termReadByte(0, &c)) return TERM_KEY_NONE;
+  if (c == '\x1b') return termReadEscape();
+  return c;
+}
+
+int termKeyPending() {
+  if (!termVt) {
+    timeout(0);
+    int key = getch();
+    timeout(termWait);
+    if (key == ERR) return 0;
+    ungetch(key);
+    return 1;
+  }
+  if (termInPos < termInLen) return 1;
+  struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+  return poll(&pfd, 1, 0) > 0;
+}
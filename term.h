@@ -0,0 +1,70 @@
+#ifndef TERM_H
+#define TERM_H
+
+/*** terminal ***/
+
+// Everything the editor draws and reads goes through here, to one of two
+// backends. The default is ncurses. The other talks to the terminal
+// itself: raw termios for input, and for output a screen of cells that
+// termRefresh diffs against what the terminal already shows, sending the
+// changes as cursor moves and SGR sequences in a single write(). It needs
+// an ANSI/VT100 terminal, which is everything still in use.
+
+// Attributes for termAttrOn and termAttrOff, or'ed with a TERM_PAIR.
+#define TERM_PAIR(n) (n)
+#define TERM_PAIR_MASK 0xff
+#define TERM_DIM (1 << 8)
+#define TERM_REVERSE (1 << 9)
+
+enum termColor {
+  TERM_BLACK,
+  TERM_RED,
+  TERM_GREEN,
+  TERM_YELLOW,
+  TERM_BLUE,
+  TERM_MAGENTA,
+  TERM_CYAN,
+  TERM_WHITE
+};
+
+// Keys that aren't a single byte. Anything else is returned as the byte.
+enum termKey {
+  TERM_KEY_NONE = -1, // nothing before the timeout
+  TERM_KEY_UP = 512,
+  TERM_KEY_DOWN,
+  TERM_KEY_LEFT,
+  TERM_KEY_RIGHT,
+  TERM_KEY_PAGE_UP,
+  TERM_KEY_PAGE_DOWN,
+  TERM_KEY_HOME,
+  TERM_KEY_END,
+  TERM_KEY_DELETE,
+  TERM_KEY_BACKSPACE,
+  TERM_KEY_ENTER,
+  TERM_KEY_RESIZE,
+  TERM_KEY_PASTE_START, // pasted text follows, up to TERM_KEY_PASTE_END
+  TERM_KEY_PASTE_END
+};
+
+// Takes over the terminal, with the VT backend if vt is set.
+void termInit(int vt);
+void termEnd();
+void termSize(int *rows, int *cols);
+void termInitPair(int pair, int fg, int bg);
+
+void termAttrOn(int attr);
+void termAttrOff(int attr);
+void termMove(int y, int x);
+void termPutText(int y, int x, const char *s, int len);
+void termPutChar(int y, int x, int c);
+void termPrintf(int y, int x, const char *fmt, ...);
+void termClearToEol();
+void termRefresh();
+
+// How long termGetKey waits for a key, in milliseconds. -1 waits for good.
+void termTimeout(int ms);
+int termGetKey();
+// Whether a key is already waiting, so termGetKey won't block.
+int termKeyPending();
+
+#endif // TERM_H
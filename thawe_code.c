@@ -7,16 +7,26 @@
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <time.h>
-#include <ncurses.h>
 #include <unistd.h>
 #include "syntax.h"
 #include "config.h"
+#include "rope.h"
+#include "lineindex.h"
+#include "hugefile.h"
+#include "save.h"
+#include "journal.h"
+#include "highlight.h"
+#include "term.h"
 
 /*** defines ***/
 
@@ -62,176 +72,92 @@ void editorSwitchBuffer();
 void editorShowBufferList();
 void editorCloseBuffer();
 void editorShowHelp();
+void editorDamageScreen();
+void editorDamageRows(int lo, int hi);
+erow *editorRowAt(int at);
+erow *editorRowReady(int at);
+void editorRowFlat(erow *row);
+int editorReadOnly();
+int editorSoftWrapping();
+int editorRowHeight(struct Buffer *b, erow *row);
 
 /*** terminal ***/
 
 void die(const char *s) {
-  endwin();   // Cleanly exit ncurses mode
+  termEnd();
 
   perror(s);
   exit(1);
 }
 
 void initColors() {
-  init_pair(COLOR_PAIR_COMMENT, COLOR_CYAN, COLOR_BLACK);
-  init_pair(COLOR_PAIR_KEYWORD1, COLOR_YELLOW, COLOR_BLACK);
-  init_pair(COLOR_PAIR_KEYWORD2, COLOR_GREEN, COLOR_BLACK);
-  init_pair(COLOR_PAIR_STRING, COLOR_MAGENTA, COLOR_BLACK);
-  init_pair(COLOR_PAIR_NUMBER, COLOR_RED, COLOR_BLACK);
-  init_pair(COLOR_PAIR_MATCH, COLOR_BLUE, COLOR_BLACK);
-  init_pair(COLOR_PAIR_NORMAL, COLOR_WHITE, COLOR_BLACK);
-  init_pair(COLOR_PAIR_GUTTER, COLOR_WHITE, COLOR_BLACK);
+  termInitPair(COLOR_PAIR_COMMENT, TERM_CYAN, TERM_BLACK);
+  termInitPair(COLOR_PAIR_KEYWORD1, TERM_YELLOW, TERM_BLACK);
+  termInitPair(COLOR_PAIR_KEYWORD2, TERM_GREEN, TERM_BLACK);
+  termInitPair(COLOR_PAIR_STRING, TERM_MAGENTA, TERM_BLACK);
+  termInitPair(COLOR_PAIR_NUMBER, TERM_RED, TERM_BLACK);
+  termInitPair(COLOR_PAIR_MATCH, TERM_BLUE, TERM_BLACK);
+  termInitPair(COLOR_PAIR_NORMAL, TERM_WHITE, TERM_BLACK);
+  termInitPair(COLOR_PAIR_GUTTER, TERM_WHITE, TERM_BLACK);
 }
 
-int editorReadKey() {
-  int key = getch();
+// Turns a key from termGetKey into the editor's own. Enter comes in as
+// a carriage return.
+int editorKey(int key) {
   switch (key)  {
-    case KEY_RESIZE:
+    case TERM_KEY_RESIZE:
       getWindowSize(&E.screenrows, &E.screencols);
       E.screenrows -= 2;
+      editorDamageScreen();
       return key;
-    case KEY_UP: return ARROW_UP;
-    case KEY_DOWN: return ARROW_DOWN;
-    case KEY_LEFT: return ARROW_LEFT;
-    case KEY_RIGHT: return ARROW_RIGHT;
-    case KEY_PPAGE: return PAGE_UP;
-    case KEY_NPAGE: return PAGE_DOWN;
-    case KEY_HOME: return HOME_KEY;
-    case KEY_END: return END_KEY;
-    case KEY_DC: return DEL_KEY;
-    case KEY_ENTER: return '\n';
+    case TERM_KEY_UP: return ARROW_UP;
+    case TERM_KEY_DOWN: return ARROW_DOWN;
+    case TERM_KEY_LEFT: return ARROW_LEFT;
+    case TERM_KEY_RIGHT: return ARROW_RIGHT;
+    case TERM_KEY_PAGE_UP: return PAGE_UP;
+    case TERM_KEY_PAGE_DOWN: return PAGE_DOWN;
+    case TERM_KEY_HOME: return HOME_KEY;
+    case TERM_KEY_END: return END_KEY;
+    case TERM_KEY_DELETE: return DEL_KEY;
+    case '\r':
+    case TERM_KEY_ENTER: return '\n';
     case 127:
-    case KEY_BACKSPACE: return BACKSPACE;
+    case TERM_KEY_BACKSPACE: return BACKSPACE;
     case 27: return '\x1b'; // Escape key
     default: return key;
   }
 }
 
+int editorReadKey() {
+  return editorKey(termGetKey());
+}
+
 int getWindowSize(int *rows, int *cols) {
-  getmaxyx(stdscr, *rows, *cols);
+  termSize(rows, cols);
   return 0;
 }
 
 /*** syntax highliting ***/
 
-int is_separator(int c) {
-  return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
-}
-
 void editorUpdateSyntax(erow *row) {
-  row->hl = realloc(row->hl, row->rsize);
-  memset(row->hl, HL_NORMAL, row->rsize);
-
-  if (CURRENT_BUFFER->syntax == NULL) return;
-
-  char **keywords = CURRENT_BUFFER->syntax->keywords;
-
-  char *scs = CURRENT_BUFFER->syntax->singleline_comment_start;
-  char *mcs = CURRENT_BUFFER->syntax->multiline_comment_start;
-  char *mce = CURRENT_BUFFER->syntax->multiline_comment_end;
-
-  int scs_len = scs ? strlen(scs) : 0;
-  int mcs_len = mcs ? strlen(mcs) : 0;
-  int mce_len = mce ? strlen(mce) : 0;
-
-  int prev_sep = 1;
-  int in_string = 0;
-  int in_comment = (row->idx > 0 && CURRENT_BUFFER->row[row->idx - 1].hl_open_comment);
-
-  int i = 0;
-  while( i < row->rsize) {
-    char c = row->render[i];
-    unsigned char prev_hl = (i > 0) ? row->hl[i - 1] : HL_NORMAL;
-
-    if (scs_len && !in_string && !in_comment) {
-      if (!strncmp(&row->render[i], scs, scs_len)) {
-        memset(&row->hl[i], HL_COMMENT, row->rsize - i);
-        break;
-      }
-    }
-
-    if (mcs_len && mce_len && !in_string) {
-      if (in_comment) {
-        row->hl[i] = HL_MLCOMMENT;
-        if (!strncmp(&row->render[i],mce, mce_len)) {
-          memset(&row->hl[i], HL_MLCOMMENT, mce_len);
-          i += mce_len;
-          in_comment = 0;
-          prev_sep = 1;
-          continue;
-        } else {
-          i++;
-          continue;
-        }
-      } else if (!strncmp(&row->render[i], mcs, mcs_len)) {
-        memset(&row->hl[i], HL_MLCOMMENT, mcs_len);
-        i +=mcs_len;
-        in_comment = 1;
-        continue;
-      }
-    }
-
-    if (CURRENT_BUFFER->syntax->flags & HL_HIGHLIGHT_STRINGS) {
-      if (in_string) {
-        row->hl[i] = HL_STRING;
-        if (c == '\\' && i + 1 < row->rsize) {
-          row->hl[i + 1] = HL_STRING;
-          i += 2;
-          continue;
-        }
-        if (c == in_string) in_string = 0;
-        i++;
-        prev_sep = 1;
-        continue;
-      } else {
-        if (c == '"' || c == '\'') {
-          in_string = c;
-          row->hl[i] = HL_STRING;
-          i++;
-          continue;
-        }
-      }
-    }
-
-    if (CURRENT_BUFFER->syntax->flags & HL_HIGHLIGHT_NUMBERS) {
-      if ((isdigit(c) && (prev_sep || prev_hl == HL_NUMBER)) ||
-        (c == '.' && prev_hl == HL_NUMBER)) {
-        row->hl[i] = HL_NUMBER;
-        i++;
-        prev_sep = 0;
-        continue;
-      }
-    }
-
-    if (prev_sep) {
-      int j;
-      for(j = 0; keywords[j]; j++) {
-        int klen = strlen(keywords[j]);
-        int kw2 = keywords[j][klen - 1] == '|';
-        if (kw2) klen--;
-
-        if (!strncmp(&row->render[i], keywords[j], klen) &&
-           is_separator(row->render[i + klen])) {
-          memset(&row->hl[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
-          i += klen;
-          break;
-        }
-      }
-      if (keywords[j] != NULL) {
-        prev_sep = 0;
-        continue;
-      }
-    }
-
-    prev_sep = is_separator(c);
-    i++;
+  if (CURRENT_BUFFER->syntax == NULL) {
+    // Plain text is HL_NORMAL throughout, which is what no spans means.
+    free(row->hl);
+    row->hl = NULL;
+    row->hl_spans = 0;
+    row->hl_open_comment = row->hl_start;
+    row->hl_gen = CURRENT_BUFFER->hl_gen;
+    return;
   }
 
-  int changed = (row->hl_open_comment != in_comment);
-  row->hl_open_comment = in_comment;
-  if (changed && row->idx + 1 < CURRENT_BUFFER->numrows) {
-    editorUpdateSyntax(&CURRENT_BUFFER->row[row->idx + 1]);
-  }
+  editorRowFlat(row);
+  unsigned char *hl = malloc(row->rsize + 1);
+  row->hl_open_comment = syntaxHighlight(CURRENT_BUFFER->syntax, row->render, row->rsize,
+                                         row->hl_start, hl);
+  free(row->hl);
+  row->hl = syntaxSpans(hl, row->rsize, &row->hl_spans);
+  row->hl_gen = CURRENT_BUFFER->hl_gen;
+  free(hl);
 }
 
 int editorSyntaxToColor(int hl) {
@@ -248,8 +174,20 @@ int editorSyntaxToColor(int hl) {
   }
 }
 
+// Throws away every row's highlighting. Rows are highlighted again as
+// they are shown.
+void editorInvalidateSyntax() {
+  editorDamageRows(0, INT_MAX);
+  CURRENT_BUFFER->hl_gen++;
+  CURRENT_BUFFER->hl_edits++;
+  CURRENT_BUFFER->hl_valid = 0;
+  CURRENT_BUFFER->hl_stale_end = 0;
+  CURRENT_BUFFER->hl_done = 0;
+}
+
 void editorSelectSyntaxHighlight() {
   CURRENT_BUFFER->syntax = NULL;
+  editorInvalidateSyntax();
   if (CURRENT_BUFFER->filename == NULL) return;
 
   char *ext = strrchr(CURRENT_BUFFER->filename, '.');
@@ -261,12 +199,9 @@ void editorSelectSyntaxHighlight() {
       int is_ext = (s->filematch[i][0] == '.');
       if ((is_ext && ext && !strcmp(ext, s->filematch[i])) ||
           (!is_ext && strstr(CURRENT_BUFFER->filename, s->filematch[i]))) {
+        syntaxCompile(s);
         CURRENT_BUFFER->syntax = s;
-
-        int filerow;
-        for (filerow = 0; filerow < CURRENT_BUFFER->numrows; filerow++) {
-          editorUpdateSyntax(&CURRENT_BUFFER->row[filerow]);
-        }
+        editorInvalidateSyntax();
         return;
       }
       i++;
@@ -276,7 +211,284 @@ void editorSelectSyntaxHighlight() {
 
 /*** row operations ***/
 
+erow *editorHugeRowAt(struct Buffer *b, int at);
+
+erow *editorRowAt(int at) {
+  if (CURRENT_BUFFER->huge) return editorHugeRowAt(CURRENT_BUFFER, at);
+  return ropeAt(CURRENT_BUFFER->rows, at);
+}
+
+// The row being typed into keeps a gap in its chars at the last edit, so
+// a keystroke in the middle of a long line doesn't move the rest of it.
+// Only rows without tabs get one, as their render is chars and nothing
+// else has to be rebuilt. Code that wants the row's text in one piece
+// closes the gap with editorRowFlat first.
+#define GAP_MIN 64
+
+void editorGapMove(struct Buffer *b, int at) {
+  char *chars = b->gap_row->chars;
+  if (b->gap_len > 0 && at < b->gap_at)
+    memmove(&chars[at + b->gap_len], &chars[at], b->gap_at - at);
+  else if (b->gap_len > 0 && at > b->gap_at)
+    memmove(&chars[b->gap_at], &chars[b->gap_at + b->gap_len], at - b->gap_at);
+  b->gap_at = at;
+}
+
+void editorGapClose(struct Buffer *b) {
+  erow *row = b->gap_row;
+  if (row == NULL) return;
+  editorGapMove(b, row->size);
+  row->chars[row->size] = '\0';
+  b->gap_row = NULL;
+}
+
+// Makes `row` the one with the gap, and puts the gap at `at`.
+void editorGapTo(erow *row, int at) {
+  struct Buffer *b = CURRENT_BUFFER;
+  if (b->gap_row != row) {
+    editorGapClose(b);
+    b->gap_row = row;
+    b->gap_at = row->size;
+    b->gap_len = 0;
+  }
+  editorGapMove(b, at);
+}
+
+void editorRowFlat(erow *row) {
+  if (row != NULL && row == CURRENT_BUFFER->gap_row) editorGapClose(CURRENT_BUFFER);
+}
+
+// Returns render[from..from+len) in one piece, moving the gap past it if
+// it falls inside. Drawing only moves it about a screen's width.
+char *editorRowRender(erow *row, int from, int len) {
+  struct Buffer *b = CURRENT_BUFFER;
+  if (row != b->gap_row) return &row->render[from];
+  if (b->gap_at > from && b->gap_at < from + len) editorGapMove(b, from + len);
+  return &row->render[b->gap_at <= from ? from + b->gap_len : from];
+}
+
+// Copies render to `dst` without the gap.
+void editorRowRenderCopy(erow *row, char *dst) {
+  struct Buffer *b = CURRENT_BUFFER;
+  if (row != b->gap_row) {
+    memcpy(dst, row->render, row->rsize);
+    return;
+  }
+  memcpy(dst, row->render, b->gap_at);
+  memcpy(dst + b->gap_at, row->render + b->gap_at + b->gap_len, row->rsize - b->gap_at);
+}
+
+void editorUpdateRow(erow *row);
+
+// Whether a row's highlighting depends on the rows above it.
+int editorSyntaxMultiline(struct editorSyntax *syntax) {
+  return syntax && syntax->multiline_comment_start &&
+         syntax->multiline_comment_start[0] != '\0';
+}
+
+// Returns the row at `at` with its render built. Nothing is highlighted
+// until it is needed for drawing or searching, and then it is left to
+// the highlighter thread: the row is noted in hl_want_lo..hl_want_hi and
+// drawn with whatever hl it has until the thread's result comes back.
+erow *editorRowReady(int at) {
+  struct Buffer *b = CURRENT_BUFFER;
+  if (at < b->hl_valid) return editorRowAt(at);
+
+  erow *row = editorRowAt(at);
+  if (row == NULL) return NULL;
+  if (row->flags & ROW_STALE) editorUpdateRow(row);
+
+  if (b->syntax == NULL) {
+    // Plain text is all HL_NORMAL, nothing worth a thread.
+    if (row->hl_gen != b->hl_gen) editorUpdateSyntax(row);
+    return row;
+  }
+  if (row->hl_gen == b->hl_gen && !editorSyntaxMultiline(b->syntax)) return row;
+
+  if (b->hl_want_hi == 0 || at < b->hl_want_lo) b->hl_want_lo = at;
+  if (at >= b->hl_want_hi) b->hl_want_hi = at + 1;
+  return row;
+}
+
+// Rows lo..hi-1 look different now, so the screen lines showing them are
+// drawn again in the next frame.
+void editorDamageRows(int lo, int hi) {
+  struct Buffer *b = CURRENT_BUFFER;
+  if (lo < b->damage_lo) b->damage_lo = lo;
+  if (hi > b->damage_hi) b->damage_hi = hi;
+}
+
+// Row `at` changed, or `shift` rows were inserted (1) or removed (-1)
+// there. The rows after it may need highlighting again, which happens
+// when they are next drawn, or bit by bit while the editor is idle.
+void editorInvalidateRows(int at, int shift) {
+  struct Buffer *b = CURRENT_BUFFER;
+  editorDamageRows(at, shift ? INT_MAX : at + 1);
+  b->hl_edits++;
+  if (b->hl_valid >= b->hl_done) b->hl_stale_end = 0;
+  if (b->hl_done > at) b->hl_done += shift;
+  if (b->hl_stale_end > at) b->hl_stale_end += shift;
+
+  if (at >= b->hl_done) return;
+  if (at < b->hl_valid) b->hl_valid = at;
+  if (at + 1 > b->hl_stale_end) b->hl_stale_end = at + 1;
+}
+
+/*** background highlighting ***/
+
+#define HL_JOB_MAX 10000 // rows handed to each highlighter thread at once
+
+// Whether rows are highlighted in order from hl_valid on, rather than just
+// the ones asked for. They have to be with multi-line comments, and are
+// when the whole file is wanted highlighted as soon as it's loaded.
+int editorHighlightInOrder(struct Buffer *b) {
+  return editorSyntaxMultiline(b->syntax) || (E.highlight_on_load && b->syntax);
+}
+
+// Moves hl_valid past rows whose hl is already right for the comment
+// state coming into them. Once past every edited row, the first such
+// row means all of the old highlighting down to hl_done holds.
+void editorSkipHighlighted(struct Buffer *b) {
+  erow *row = editorRowAt(b->hl_valid);
+  erow *prev = row ? ropePrev(row) : NULL;
+  int in_comment = prev ? prev->hl_open_comment : 0;
+  while (row && row->hl_gen == b->hl_gen && row->hl_start == in_comment) {
+    if (b->hl_valid >= b->hl_stale_end && b->hl_valid < b->hl_done) {
+      b->hl_valid = b->hl_done;
+      row = editorRowAt(b->hl_valid);
+      if (row == NULL) break;
+      in_comment = ropePrev(row)->hl_open_comment;
+      continue;
+    }
+    in_comment = row->hl_open_comment;
+    if (++b->hl_valid > b->hl_done) b->hl_done = b->hl_valid;
+    row = ropeNext(row);
+  }
+}
+
+// Hands the next rows that need highlighting to the highlighter threads.
+// In order, those are the rows from hl_valid on, down to the last one
+// asked for or highlighted before the edits (or the end of the file with
+// highlight-on-load), a job at a time. Otherwise rows stand alone and
+// only the ones asked for are done.
+void editorStartHighlight() {
+  struct Buffer *b = CURRENT_BUFFER;
+  int in_order = editorHighlightInOrder(b);
+  int max = HL_JOB_MAX * hlJobThreads();
+  int first, last;
+
+  if (in_order) {
+    editorSkipHighlighted(b);
+    last = b->hl_want_hi > b->hl_done ? b->hl_want_hi : b->hl_done;
+    if (E.highlight_on_load) last = b->numrows;
+    if (last > b->numrows) last = b->numrows;
+    if (b->hl_valid >= last) {
+      b->hl_want_lo = b->hl_want_hi = 0;
+      return;
+    }
+    first = b->hl_valid;
+    if (last > first + max) last = first + max;
+  } else {
+    // Rows passed over on the way somewhere are asked for again if they
+    // ever get drawn.
+    last = b->hl_want_hi < b->numrows ? b->hl_want_hi : b->numrows;
+    first = b->hl_want_lo > last - max ? b->hl_want_lo : last - max;
+    b->hl_want_lo = b->hl_want_hi = 0;
+    if (b->syntax == NULL || first >= last) return;
+  }
+
+  int count = last - first;
+  char **lines = malloc(sizeof(char *) * count);
+  int *lens = malloc(sizeof(int) * count);
+  erow *row = editorRowAt(first);
+  erow *prev = ropePrev(row);
+  int in_comment = in_order && prev ? prev->hl_open_comment : 0;
+  for (int i = 0; i < count; i++, row = ropeNext(row)) {
+    if (row->flags & ROW_STALE) editorUpdateRow(row);
+    lines[i] = malloc(row->rsize + 1);
+    editorRowRenderCopy(row, lines[i]);
+    lines[i][row->rsize] = '\0';
+    lens[i] = row->rsize;
+  }
+
+  b->hl_job = hlJobStart(b->syntax, in_comment, lines, lens, count);
+  b->hl_job_first = first;
+  b->hl_job_count = count;
+  b->hl_job_edits = b->hl_edits;
+}
+
+// Puts the hl from a finished job on its rows. If any row was edited
+// since the job started, the results are thrown away and the rows asked
+// for again the next time they are drawn.
+void editorFinishHighlight() {
+  struct Buffer *b = CURRENT_BUFFER;
+  struct hlJob *j = b->hl_job;
+  b->hl_job = NULL;
+
+  if (b->hl_job_edits == b->hl_edits) {
+    int in_order = editorHighlightInOrder(b);
+    int at = b->hl_job_first;
+    erow *row = editorRowAt(at);
+    erow *prev = row ? ropePrev(row) : NULL;
+    int in_comment = in_order && prev ? prev->hl_open_comment : 0;
+
+    for (int i = 0; i < b->hl_job_count && row; i++, at++, row = ropeNext(row)) {
+      // Old highlighting that still holds is picked up by
+      // editorSkipHighlighted instead.
+      if (in_order && at >= b->hl_stale_end && at < b->hl_done &&
+          row->hl_gen == b->hl_gen && row->hl_start == in_comment)
+        break;
+
+      int open;
+      free(row->hl);
+      row->hl = hlJobTake(j, i, &row->hl_spans, &open);
+      row->hl_start = in_comment;
+      row->hl_open_comment = open;
+      row->hl_gen = b->hl_gen;
+      if (in_order) {
+        in_comment = open;
+        b->hl_valid = at + 1;
+        if (b->hl_valid > b->hl_done) b->hl_done = b->hl_valid;
+      }
+    }
+    editorDamageRows(b->hl_job_first, at);
+  }
+  hlJobFree(j);
+}
+
+// Rows loaded from a mapping share the file's pages until they are first
+// edited, at which point they get a private copy of their text.
+int editorRowShared(erow *row);
+void editorOrphan(struct Buffer *b, char *chars);
+
+// Gives a row borrowing its text from the mapping or from a running save
+// a copy of its own.
+void editorRowCopyChars(struct Buffer *b, erow *row) {
+  char *chars = malloc(row->size + 1);
+  memcpy(chars, row->chars, row->size);
+  chars[row->size] = '\0';
+  if (!(row->flags & ROW_MAPPED)) editorOrphan(b, row->chars);
+  row->chars = chars;
+  if (row->flags & ROW_RENDER_CHARS) row->render = chars;
+  row->flags &= ~ROW_MAPPED;
+  row->gen = b->save_gen;
+}
+
+void editorMarkDirtyFrom(int at) {
+  if (at < CURRENT_BUFFER->first_dirty) CURRENT_BUFFER->first_dirty = at;
+}
+
+// Called before a row's text is changed in place.
+void editorRowMakeWritable(erow *row) {
+  int at = ropeIndex(row);
+  editorMarkDirtyFrom(at);
+  editorInvalidateRows(at, 0);
+  if ((row->flags & ROW_MAPPED) || editorRowShared(row))
+    editorRowCopyChars(CURRENT_BUFFER, row);
+}
+
 int editorRowCxToRx(erow *row, int cx) {
+  if (row->flags & ROW_RENDER_CHARS) return cx;
   int rx = 0;
   int j;
   for (j = 0; j < cx; j++) {
@@ -288,6 +500,7 @@ int editorRowCxToRx(erow *row, int cx) {
 }
 
 int editorRowRxToCx(erow *row, int rx) {
+  if (row->flags & ROW_RENDER_CHARS) return rx < row->size ? rx : row->size;
   int cur_rx = 0;
   int cx;
   for (cx = 0; cx < row->size; cx++) {
@@ -318,13 +531,35 @@ char *editorGetIdent(erow *row) {
   return ident;
 }
 
+void editorRowRendered(erow *row, int rsize) {
+  // Highlighting waits until the row is drawn, and until the highlighter
+  // gets to it the row is drawn with its old hl.
+  row->hl_gen = CURRENT_BUFFER->hl_gen - 1;
+
+  row->rsize = rsize;
+  if (CURRENT_BUFFER->wrap_width)
+    ropeSetHeight(row, rsize / CURRENT_BUFFER->wrap_width + 1);
+  row->flags &= ~ROW_STALE;
+}
+
+// A row without tabs renders as its own text, so render points at chars
+// rather than a copy of them. It then isn't NUL terminated when chars is
+// in the file mapping.
 void editorUpdateRow(erow *row) {
   int tabs = 0;
   int j;
+  editorRowFlat(row);
   for (j = 0; j < row->size; j++)
     if (row->chars[j] == '\t') tabs++;
 
-  free(row->render);
+  if (!(row->flags & ROW_RENDER_CHARS)) free(row->render);
+  row->flags &= ~ROW_RENDER_CHARS;
+  if (tabs == 0) {
+    row->render = row->chars;
+    row->flags |= ROW_RENDER_CHARS;
+    editorRowRendered(row, row->size);
+    return;
+  }
   row->render = malloc(row->size + tabs*(CURRENT_BUFFER->tab_stop - 1) + 1);
 
   int idx = 0;
@@ -337,52 +572,97 @@ void editorUpdateRow(erow *row) {
     }
   }
   row->render[idx] = '\0';
-  row->rsize = idx;
+  editorRowRendered(row, idx);
+}
 
-  editorUpdateSyntax(row);
+// Records a change to the rows in the buffer's journal, starting a new
+// journal on the first edit since the file was opened or saved.
+void editorJournal(int op, int row, int at, const char *s, int len) {
+  struct Buffer *b = CURRENT_BUFFER;
+  if (!b->journaling || b->filename == NULL) return;
+  if (b->journal == NULL) {
+    char *path = journalPath(b->filename);
+    b->journal = path ? journalCreate(path, &b->disk) : NULL;
+    free(path);
+    if (b->journal == NULL) {
+      b->journaling = 0;
+      editorSetStatusMessage("Can't create journal: %s", strerror(errno));
+      return;
+    }
+  }
+  journalAdd(b->journal, op, row, at, s, len);
 }
 
 void editorInsertRow(int at, char *s, size_t len) {
   if (at < 0 || at > CURRENT_BUFFER->numrows) return;
-
-  CURRENT_BUFFER->row = realloc(CURRENT_BUFFER->row, sizeof(erow) * (CURRENT_BUFFER->numrows + 1));
-  memmove(&CURRENT_BUFFER->row[at + 1], &CURRENT_BUFFER->row[at], sizeof(erow) * (CURRENT_BUFFER->numrows - at));
-  for (int j = at + 1; j <= CURRENT_BUFFER->numrows; j++) CURRENT_BUFFER->row[j].idx++;
-
-  CURRENT_BUFFER->row[at].idx = at;
-
-  CURRENT_BUFFER->row[at].size = len;
-  CURRENT_BUFFER->row[at].chars = malloc(len + 1);
-  memcpy(CURRENT_BUFFER->row[at].chars, s, len);
-  CURRENT_BUFFER->row[at].chars[len] = '\0';
-
-  CURRENT_BUFFER->row[at].rsize = 0;
-  CURRENT_BUFFER->row[at].render = NULL;
-  CURRENT_BUFFER->row[at].hl = NULL;
-  CURRENT_BUFFER->row[at].hl_open_comment = 0;
-  editorUpdateRow(&CURRENT_BUFFER->row[at]);
-
+  editorJournal(JOURNAL_INSERT_ROW, at, 0, s, len);
+
+  erow *row = ropeInsert(CURRENT_BUFFER->rows, at);
+  if (row == NULL) die("ropeInsert");
+
+  row->size = len;
+  row->chars = malloc(len + 1);
+  memcpy(row->chars, s, len);
+  row->chars[len] = '\0';
+  row->gen = CURRENT_BUFFER->save_gen;
+  editorMarkDirtyFrom(at);
+
+  row->rsize = 0;
+  row->render = NULL;
+  row->hl = NULL;
+  row->hl_spans = 0;
+  row->hl_start = 0;
+  row->hl_open_comment = 0;
+  row->flags = 0;
+  editorUpdateRow(row);
+  editorInvalidateRows(at, 1);
   CURRENT_BUFFER->numrows++;
   CURRENT_BUFFER->dirty++;
 }
 
 void editorFreeRow(erow *row) {
-  free(row->render);
-  free(row->chars);
+  if (row == CURRENT_BUFFER->gap_row) CURRENT_BUFFER->gap_row = NULL;
+  if (!(row->flags & ROW_RENDER_CHARS)) free(row->render);
+  if (editorRowShared(row)) editorOrphan(CURRENT_BUFFER, row->chars);
+  else if (!(row->flags & ROW_MAPPED)) free(row->chars);
   free(row->hl);
 }
 
 void editorDelRow(int at) {
   if (at < 0 || at >= CURRENT_BUFFER->numrows) return;
-  editorFreeRow(&CURRENT_BUFFER->row[at]);
-  memmove(&CURRENT_BUFFER->row[at], &CURRENT_BUFFER->row[at + 1], sizeof(erow) * (CURRENT_BUFFER->numrows - at - 1));
-  for (int j = at; j < CURRENT_BUFFER->numrows - 1; j++) CURRENT_BUFFER->row[j].idx--;
+  editorJournal(JOURNAL_DELETE_ROW, at, 0, NULL, 0);
+  erow *row = editorRowAt(at);
+  editorFreeRow(row);
+  ropeRemove(CURRENT_BUFFER->rows, row);
+  editorMarkDirtyFrom(at);
+  editorInvalidateRows(at, -1);
   CURRENT_BUFFER->numrows--;
   CURRENT_BUFFER->dirty++;
 }
 
 void editorRowInsertChar(erow *row, int at, int c) {
   if (at < 0 || at > row->size) at = row->size;
+  char ch = c;
+  editorJournal(JOURNAL_INSERT, ropeIndex(row), at, &ch, 1);
+  editorRowMakeWritable(row);
+  if ((row->flags & ROW_RENDER_CHARS) && c != '\t') {
+    struct Buffer *b = CURRENT_BUFFER;
+    editorGapTo(row, at);
+    if (b->gap_len == 0) {
+      int grow = row->size / 8 + GAP_MIN;
+      row->chars = realloc(row->chars, row->size + grow + 1);
+      memmove(&row->chars[at + grow], &row->chars[at], row->size - at + 1);
+      row->render = row->chars;
+      b->gap_len = grow;
+    }
+    row->chars[b->gap_at++] = c;
+    b->gap_len--;
+    row->size++;
+    editorRowRendered(row, row->size);
+    CURRENT_BUFFER->dirty++;
+    return;
+  }
+  editorRowFlat(row);
   row->chars = realloc(row->chars, row->size + 2);
   memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
   row->size++;
@@ -394,7 +674,17 @@ void editorRowInsertChar(erow *row, int at, int c) {
 void editorRowDelChar(erow *row, int at, int count) {
   if (at < 0 || at >= row->size) return;
   if (at + count > row->size) count = row->size - at;
-
+  editorJournal(JOURNAL_DELETE, ropeIndex(row), at, NULL, count);
+
+  editorRowMakeWritable(row);
+  if (row->flags & ROW_RENDER_CHARS) {
+    editorGapTo(row, at);
+    CURRENT_BUFFER->gap_len += count;
+    row->size -= count;
+    editorRowRendered(row, row->size);
+    CURRENT_BUFFER->dirty++;
+    return;
+  }
   memmove(&row->chars[at], &row->chars[at + count], row->size - at - count);
   row->size -= count;
   row->chars[row->size] = '\0';
@@ -402,38 +692,65 @@ void editorRowDelChar(erow *row, int at, int count) {
   CURRENT_BUFFER->dirty++;
 }
 
-void editorRowAppendString(erow *row, char *s, size_t len) {
+void editorRowInsertString(erow *row, int at, const char *s, size_t len) {
+  if (at < 0 || at > row->size) at = row->size;
+  editorJournal(JOURNAL_INSERT, ropeIndex(row), at, s, len);
+  editorRowMakeWritable(row);
+  editorRowFlat(row);
   row->chars = realloc(row->chars, row->size + len + 1);
-  memcpy(&row->chars[row->size], s, len);
+  memmove(&row->chars[at + len], &row->chars[at], row->size - at);
+  memcpy(&row->chars[at], s, len);
   row->size += len;
   row->chars[row->size] = '\0';
   editorUpdateRow(row);
   CURRENT_BUFFER->dirty++;
 }
 
+void editorRowAppendString(erow *row, char *s, size_t len) {
+  editorRowInsertString(row, row->size, s, len);
+}
+
 /*** editor operations ***/
 
+void editorPollLoader(struct Buffer *b);
+
+// Text added past the last row belongs at the end of the file. While the
+// file is still loading that is further down than the rows so far, so the
+// rest is loaded first and the cursor moved after it.
+void editorLoadToEnd() {
+  struct Buffer *b = CURRENT_BUFFER;
+  if (b->loader == NULL || b->cy != b->numrows) return;
+  lineLoaderWait(b->loader);
+  editorPollLoader(b);
+  b->cy = b->numrows;
+}
+
 void editorInsertChar(int c) {
+  if (editorReadOnly()) return;
+  editorLoadToEnd();
   if (CURRENT_BUFFER->cy == CURRENT_BUFFER->numrows) {
     editorInsertRow(CURRENT_BUFFER->numrows, "", 0);
   }
-  editorRowInsertChar(&CURRENT_BUFFER->row[CURRENT_BUFFER->cy], CURRENT_BUFFER->cx, c);
+  editorRowInsertChar(editorRowAt(CURRENT_BUFFER->cy), CURRENT_BUFFER->cx, c);
   editorAddUndoAction(ACTION_INSERT, (char *)&c, 1);
   CURRENT_BUFFER->cx++;
   editorApplyHardWrap();
 }
 
 void editorInsertNewline() {
+  if (editorReadOnly()) return;
+  editorLoadToEnd();
   char *ident = NULL;
   if (CURRENT_BUFFER->cy < CURRENT_BUFFER->numrows) {
-    ident = editorGetIdent(&CURRENT_BUFFER->row[CURRENT_BUFFER->cy]);
+    editorRowFlat(editorRowAt(CURRENT_BUFFER->cy));
+    ident = editorGetIdent(editorRowAt(CURRENT_BUFFER->cy));
   }
   int ident_len = (ident) ? strlen(ident) : 0;
   
   if (CURRENT_BUFFER->cx == 0) {
     editorInsertRow(CURRENT_BUFFER->cy, ident ? ident : "", ident_len);
   } else {
-    erow *row = &CURRENT_BUFFER->row[CURRENT_BUFFER->cy];
+    erow *row = editorRowAt(CURRENT_BUFFER->cy);
     size_t len_after_cursor = row->size - CURRENT_BUFFER->cx;
     char *new_content = malloc(ident_len + len_after_cursor + 1);
     if (ident) {
@@ -445,10 +762,7 @@ void editorInsertNewline() {
     editorInsertRow(CURRENT_BUFFER->cy + 1, new_content, ident_len + len_after_cursor);
     free(new_content);
 
-    row = &CURRENT_BUFFER->row[CURRENT_BUFFER->cy];
-    row->size = CURRENT_BUFFER->cx;
-    row->chars[row->size] = '\0';
-    editorUpdateRow(row);
+    editorRowDelChar(row, CURRENT_BUFFER->cx, len_after_cursor);
   }
   CURRENT_BUFFER->cy++;
   CURRENT_BUFFER->cx = ident_len;
@@ -461,10 +775,11 @@ void editorInsertNewline() {
 void editorApplyHardWrap() {
   if (!E.hard_wrap) return;
 
-  erow *row = &CURRENT_BUFFER->row[CURRENT_BUFFER->cy];
+  erow *row = editorRowAt(CURRENT_BUFFER->cy);
   int wrap_width = E.screencols - 5;
 
   if (row->rsize <= wrap_width) return;
+  editorRowFlat(row);
 
   int wrap_char_idx = editorRowRxToCx(row, wrap_width);
 
@@ -490,11 +805,7 @@ void editorApplyHardWrap() {
 
   editorInsertRow(CURRENT_BUFFER->cy + 1, content_to_move, len_to_move);
 
-  row = &CURRENT_BUFFER->row[CURRENT_BUFFER->cy]; // Re-fetch the pointer after realloc
-
-  row->size = break_char_idx;
-  row->chars[row->size] = '\0';
-  editorUpdateRow(row);
+  editorRowDelChar(row, break_char_idx, row->size - break_char_idx);
 
   if (CURRENT_BUFFER->cx > break_char_idx) {
     CURRENT_BUFFER->cy++;
@@ -503,10 +814,14 @@ void editorApplyHardWrap() {
 }
 
 void editorDelChar() {
+  if (editorReadOnly()) return;
   if (CURRENT_BUFFER->cy == CURRENT_BUFFER->numrows) return;
   if (CURRENT_BUFFER->cx == 0 && CURRENT_BUFFER->cy == 0) return;
 
-  erow *row = &CURRENT_BUFFER->row[CURRENT_BUFFER->cy];
+  erow *row = editorRowAt(CURRENT_BUFFER->cy);
+  // Only the text before the cursor is looked at, which is in one piece
+  // once the gap is at the cursor.
+  if (row == CURRENT_BUFFER->gap_row) editorGapTo(row, CURRENT_BUFFER->cx);
   if (CURRENT_BUFFER->cx > 0) {
     if (CURRENT_BUFFER->soft_tabs && (CURRENT_BUFFER->cx % CURRENT_BUFFER->tab_stop == 0)) {
       if (CURRENT_BUFFER->cx >= CURRENT_BUFFER->tab_stop) {
@@ -540,8 +855,10 @@ void editorDelChar() {
     char newline_char = '\n';
     editorAddUndoAction(ACTION_DELETE, &newline_char, 1);
 
-    CURRENT_BUFFER->cx = CURRENT_BUFFER->row[CURRENT_BUFFER->cy - 1].size;
-    editorRowAppendString(&CURRENT_BUFFER->row[CURRENT_BUFFER->cy - 1], row->chars, row->size);
+    erow *prev = editorRowAt(CURRENT_BUFFER->cy - 1);
+    editorRowFlat(row);
+    CURRENT_BUFFER->cx = prev->size;
+    editorRowAppendString(prev, row->chars, row->size);
     editorDelRow(CURRENT_BUFFER->cy);
     CURRENT_BUFFER->cy--;
   }
@@ -568,8 +885,9 @@ void editorCopy() {
 
   int total_len = 0;
 
-  for (int i = start_row; i <= end_row; i++) {
-    erow *row = &CURRENT_BUFFER->row[i];
+  editorGapClose(CURRENT_BUFFER);
+  erow *row = editorRowAt(start_row);
+  for (int i = start_row; i <= end_row; i++, row = ropeNext(row)) {
     int row_start = (i == start_row) ? start_col : 0;
     int row_end = (i == end_row) ? end_col : row->size;
     total_len += (row_end - row_start);
@@ -583,8 +901,8 @@ void editorCopy() {
 
   char *p = CURRENT_BUFFER->clipboard;
 
-  for (int i = start_row; i <= end_row; i++) {
-    erow *row = &CURRENT_BUFFER->row[i];
+  row = editorRowAt(start_row);
+  for (int i = start_row; i <= end_row; i++, row = ropeNext(row)) {
     int row_start = (i == start_row) ? start_col : 0;
     int row_end = (i == end_row) ? end_col : row->size;
     int row_len = row_end - row_start;
@@ -602,34 +920,25 @@ void editorCopy() {
   editorSetStatusMessage("%d bytes copied to clipboard.", total_len);
 }
 
-void editorDeleteSelection() {
-  if (!CURRENT_BUFFER->selection_active) return;
-
-  // Determine start and end points
-  int start_row, start_col, end_row, end_col;
-  if (CURRENT_BUFFER->cy < CURRENT_BUFFER->mark_cy || (CURRENT_BUFFER->cy == CURRENT_BUFFER->mark_cy && CURRENT_BUFFER->cx < CURRENT_BUFFER->mark_cx)) {
-    start_row = CURRENT_BUFFER->cy; start_col = CURRENT_BUFFER->cx;
-    end_row = CURRENT_BUFFER->mark_cy; end_col = CURRENT_BUFFER->mark_cx;
-  } else {
-    start_row = CURRENT_BUFFER->mark_cy; start_col = CURRENT_BUFFER->mark_cx;
-    end_row = CURRENT_BUFFER->cy; end_col = CURRENT_BUFFER->cx;
-  }
-
+// Deletes the text from (start_row, start_col) up to (end_row, end_col),
+// leaving the cursor where it started.
+void editorDeleteRange(int start_row, int start_col, int end_row, int end_col) {
   CURRENT_BUFFER->cy = start_row;
   CURRENT_BUFFER->cx = start_col;
 
   if (start_row == end_row) {
     // Single-line deletion
-    editorRowDelChar(&CURRENT_BUFFER->row[start_row], start_col, end_col - start_col);
+    editorRowDelChar(editorRowAt(start_row), start_col, end_col - start_col);
   } else {
     // Multi-line deletion
-    erow *first_row = &CURRENT_BUFFER->row[start_row];
-    erow *last_row = &CURRENT_BUFFER->row[end_row];
+    erow *first_row = editorRowAt(start_row);
+    erow *last_row = editorRowAt(end_row);
 
     editorRowDelChar(first_row, start_col, first_row->size - start_col);
 
     editorRowDelChar(last_row, 0, end_col);
 
+    editorRowFlat(last_row);
     editorRowAppendString(first_row, last_row->chars, last_row->size);
 
     for (int i = end_row; i > start_row; i--) {
@@ -637,20 +946,122 @@ void editorDeleteSelection() {
     }
   }
 
-  CURRENT_BUFFER->selection_active = 0;
   CURRENT_BUFFER->dirty++;
 }
 
+void editorDeleteSelection() {
+  if (!CURRENT_BUFFER->selection_active) return;
+  if (editorReadOnly()) return;
+
+  // Determine start and end points
+  int start_row, start_col, end_row, end_col;
+  if (CURRENT_BUFFER->cy < CURRENT_BUFFER->mark_cy || (CURRENT_BUFFER->cy == CURRENT_BUFFER->mark_cy && CURRENT_BUFFER->cx < CURRENT_BUFFER->mark_cx)) {
+    start_row = CURRENT_BUFFER->cy; start_col = CURRENT_BUFFER->cx;
+    end_row = CURRENT_BUFFER->mark_cy; end_col = CURRENT_BUFFER->mark_cx;
+  } else {
+    start_row = CURRENT_BUFFER->mark_cy; start_col = CURRENT_BUFFER->mark_cx;
+    end_row = CURRENT_BUFFER->cy; end_col = CURRENT_BUFFER->cx;
+  }
+
+  editorDeleteRange(start_row, start_col, end_row, end_col);
+  CURRENT_BUFFER->selection_active = 0;
+}
+
+// Inserts text that may run over several rows at the cursor, leaving the
+// cursor after it. Each line goes in whole, so this costs a row insert
+// per line rather than an edit per character.
+void editorInsertText(const char *s, size_t len) {
+  struct Buffer *b = CURRENT_BUFFER;
+  editorLoadToEnd();
+  if (b->cy == b->numrows) editorInsertRow(b->numrows, "", 0);
+  erow *row = editorRowAt(b->cy);
+
+  const char *nl = memchr(s, '\n', len);
+  if (nl == NULL) {
+    editorRowInsertString(row, b->cx, s, len);
+    b->cx += len;
+    return;
+  }
+
+  // The rest of the cursor's row moves to the end of the last line.
+  editorRowFlat(row);
+  size_t tail_len = row->size - b->cx;
+  const char *end = s + len;
+  const char *last = (const char *)memrchr(s, '\n', len) + 1;
+  size_t last_len = end - last;
+  char *last_row = malloc(last_len + tail_len + 1);
+  memcpy(last_row, last, last_len);
+  memcpy(last_row + last_len, &row->chars[b->cx], tail_len);
+
+  editorRowDelChar(row, b->cx, tail_len);
+  editorRowInsertString(row, b->cx, s, nl - s);
+  int at = b->cy + 1;
+  for (const char *p = nl + 1; p < last; p = nl + 1) {
+    nl = memchr(p, '\n', last - p);
+    editorInsertRow(at++, (char *)p, nl - p);
+  }
+  editorInsertRow(at, last_row, last_len + tail_len);
+  free(last_row);
+
+  b->cy = at;
+  b->cx = last_len;
+}
+
+// Pasting goes in as one edit: no auto-indent or hard wrap, which would
+// mangle text that is already laid out, and a single step to undo.
+void editorPasteText(const char *s, size_t len) {
+  if (len == 0 || editorReadOnly()) return;
+  editorLoadToEnd();
+  editorAddUndoAction(ACTION_PASTE, (char *)s, len);
+  editorInsertText(s, len);
+}
+
 void editorPaste() {
   if (CURRENT_BUFFER->clipboard == NULL) return;
+  editorPasteText(CURRENT_BUFFER->clipboard, strlen(CURRENT_BUFFER->clipboard));
+}
 
-  for (int i = 0; CURRENT_BUFFER->clipboard[i] != '\0'; i++) {
-    if (CURRENT_BUFFER->clipboard[i] == '\n') {
-      editorInsertNewline();
-    } else {
-      editorInsertChar(CURRENT_BUFFER->clipboard[i]);
+// Reads text pasted into the terminal, which it sends between paste
+// brackets, and inserts it all at once.
+void editorReadPaste() {
+  size_t len = 0;
+  size_t cap = 4096;
+  char *buf = malloc(cap);
+  int full = buf == NULL;
+  int cr = 0;
+  // The end bracket can be a while behind a big paste, but shouldn't
+  // leave the editor stuck if it never comes.
+  termTimeout(1000);
+  int c;
+  while ((c = termGetKey()) != TERM_KEY_PASTE_END && c != TERM_KEY_NONE) {
+    // A pasted CR is a line end, not Enter, and is kept apart from '\n'.
+    if (c != '\r') c = editorKey(c);
+    if (c < 0 || c > 255) continue;
+    // A pasted DEL comes in as the backspace key. Typing can't put one in
+    // the buffer, and neither does pasting.
+    if (c == BACKSPACE) continue;
+    // CRLF and a lone CR both end a line.
+    int after_cr = cr;
+    cr = c == '\r';
+    if (c == '\n' && after_cr) continue;
+    if (c == '\r') c = '\n';
+    // Out of memory, the rest of the paste is still read so it doesn't
+    // end up taken as keys.
+    if (full) continue;
+    if (len == cap) {
+      char *grown = realloc(buf, cap * 2);
+      if (grown == NULL) {
+        full = 1;
+        continue;
+      }
+      buf = grown;
+      cap *= 2;
     }
+    buf[len++] = c;
   }
+  editorPasteText(buf, len);
+  free(buf);
+  if (full) editorSetStatusMessage("Paste cut short: %s", strerror(ENOMEM));
 }
 
 void editorCut() {
@@ -694,18 +1105,30 @@ void editorUndo() {
   CURRENT_BUFFER->cx = action->cx;
   CURRENT_BUFFER->cy = action->cy;
 
-  if (action->type ==ACTION_INSERT) {
+  if (action->type == ACTION_PASTE) {
+    int end_row = action->cy;
+    int end_col = action->cx;
+    for (size_t i = 0; i < action->len; i++) {
+      if (action->data[i] == '\n') {
+        end_row++;
+        end_col = 0;
+      } else {
+        end_col++;
+      }
+    }
+    editorDeleteRange(action->cy, action->cx, end_row, end_col);
+  } else if (action->type ==ACTION_INSERT) {
     if (action->data[0] == '\n') {
       editorDelRow(CURRENT_BUFFER->cy);
     } else {
-      editorRowDelChar(&CURRENT_BUFFER->row[CURRENT_BUFFER->cy], CURRENT_BUFFER->cx - action->len, action->len);
+      editorRowDelChar(editorRowAt(CURRENT_BUFFER->cy), CURRENT_BUFFER->cx - action->len, action->len);
     }
   } else {
     if (action->data[0] == '\n') {
       editorInsertNewline();
     } else {
       for (size_t i = 0; i < action->len; i++) {
-        editorRowInsertChar(&CURRENT_BUFFER->row[CURRENT_BUFFER->cy], CURRENT_BUFFER->cx + i, action->data[i]);
+        editorRowInsertChar(editorRowAt(CURRENT_BUFFER->cy), CURRENT_BUFFER->cx + i, action->data[i]);
       }
     }
   }
@@ -721,41 +1144,678 @@ void editorRedo() {
   CURRENT_BUFFER->cx = action->cx;
   CURRENT_BUFFER->cy = action->cy;
 
-  if (action->type == ACTION_INSERT) {
+  if (action->type == ACTION_PASTE) {
+    editorInsertText(action->data, action->len);
+  } else if (action->type == ACTION_INSERT) {
     if (action->data[0] == '\n') {
       editorInsertNewline();
     } else {
       for (size_t i = 0; i < action->len; i++) {
-        editorRowInsertChar(&CURRENT_BUFFER->row[CURRENT_BUFFER->cy], CURRENT_BUFFER->cx + i, action->data[i]);
+        editorRowInsertChar(editorRowAt(CURRENT_BUFFER->cy), CURRENT_BUFFER->cx + i, action->data[i]);
       }
     }
   } else {
     if (action->data[0] == '\n') {
       editorDelRow(CURRENT_BUFFER->cy);
     } else {
-      editorRowDelChar(&CURRENT_BUFFER->row[CURRENT_BUFFER->cy], CURRENT_BUFFER->cx - action->len, action->len);
+      editorRowDelChar(editorRowAt(CURRENT_BUFFER->cy), CURRENT_BUFFER->cx - action->len, action->len);
     }
   }
 }
 /*** file i/o ***/
 
-char *editorRowsToString(int *buflen) {
-  int totlen = 0;
-  int j;
-  for (j = 0; j < CURRENT_BUFFER->numrows; j++)
-    totlen += CURRENT_BUFFER->row[j].size + 1;
-  *buflen = totlen;
+// Rows keep the text they had when a background save snapshotted them
+// until that save finishes: an edit gives the row a fresh copy, and the
+// old text is only freed once the save is done with it. Rows whose text
+// was allocated after the snapshot are edited in place as usual.
+int editorRowShared(erow *row) {
+  return CURRENT_BUFFER->save && !(row->flags & ROW_MAPPED) &&
+         row->gen != CURRENT_BUFFER->save_gen;
+}
+
+void editorOrphan(struct Buffer *b, char *chars) {
+  b->orphans = realloc(b->orphans, sizeof(char *) * (b->numorphans + 1));
+  b->orphans[b->numorphans++] = chars;
+}
+
+// Describes the file contents from row `first` on, which starts at byte
+// `offset`, as iovecs pointing straight at the rows' text. Unedited rows
+// next to each other in the mapping already have their newlines between
+// them, so they share one iovec. Rows are given the offsets they will
+// have in the saved file.
+struct iovec *editorSnapshot(struct Buffer *b, int first, off_t offset, int *iovcnt) {
+  struct iovec *iov = NULL;
+  int n = 0, cap = 0;
+  char *map_end = b->map + b->map_size;
+
+  editorGapClose(b);
+  for (erow *row = ropeAt(b->rows, first); row; row = ropeNext(row)) {
+    row->file_offset = offset;
+    offset += row->size + 1;
+
+    if (n + 2 > cap) {
+      cap = cap ? cap * 2 : 1024;
+      iov = realloc(iov, sizeof(struct iovec) * cap);
+    }
+
+    if ((row->flags & ROW_MAPPED) && row->chars + row->size < map_end &&
+        row->chars[row->size] == '\n') {
+      if (n > 0 && (char *)iov[n - 1].iov_base + iov[n - 1].iov_len == row->chars) {
+        iov[n - 1].iov_len += row->size + 1;
+      } else {
+        iov[n].iov_base = row->chars;
+        iov[n++].iov_len = row->size + 1;
+      }
+      continue;
+    }
+
+    iov[n].iov_base = row->chars;
+    iov[n++].iov_len = row->size;
+    iov[n].iov_base = "\n";
+    iov[n++].iov_len = 1;
+  }
+
+  *iovcnt = n;
+  return iov;
+}
+
+#define SAVE_IN_PLACE_MIN (1 << 20)
+
+// Whether the file is still exactly what was last read or written.
+int editorDiskUnchanged(struct Buffer *b) {
+  struct stat st;
+  if (!b->disk_valid || stat(b->filename, &st) == -1) return 0;
+  return st.st_dev == b->disk.st_dev && st.st_ino == b->disk.st_ino &&
+         st.st_size == b->disk.st_size &&
+         st.st_mtim.tv_sec == b->disk.st_mtim.tv_sec &&
+         st.st_mtim.tv_nsec == b->disk.st_mtim.tv_nsec;
+}
+
+// Hands a snapshot of b to the writer thread. Editing carries on while it
+// runs, and editorFinishSave picks up the result.
+void editorStartSave(struct Buffer *b) {
+  // Everything before the first changed row is still on disk as it is.
+  int first = b->first_dirty < b->numrows ? b->first_dirty : b->numrows;
+  off_t offset = 0;
+  if (first > 0) {
+    erow *row = ropeAt(b->rows, first - 1);
+    offset = row->file_offset + row->size + 1;
+  }
+
+  // When that's most of a big file, only the rest is rewritten, in place.
+  // Otherwise the whole file is written out to a new copy, as it is when
+  // the file changed under us, or while following it, where our own
+  // writes would come back as appended lines.
+  int in_place = b->follow_fd == -1 && offset >= SAVE_IN_PLACE_MIN &&
+                 editorDiskUnchanged(b) && offset >= b->disk.st_size / 2;
+  if (in_place) {
+    // The rows being rewritten can't keep borrowing from the mapping.
+    for (erow *row = ropeAt(b->rows, first); row; row = ropeNext(row))
+      if (row->flags & ROW_MAPPED) editorRowCopyChars(b, row);
+  } else {
+    first = 0;
+    offset = 0;
+  }
+
+  int iovcnt;
+  struct iovec *iov = editorSnapshot(b, first, offset, &iovcnt);
+  b->save = saveStart(b->filename, in_place ? offset : -1, iov, iovcnt);
+  if (b->save == NULL) {
+    // Nothing was written, so the buffer stays as dirty as it was.
+    free(iov);
+    editorSetStatusMessage("Can't save! %s", strerror(ENOMEM));
+    return;
+  }
+  b->save_gen++;
+  b->save_dirty = b->dirty;
+  b->save_first_dirty = b->first_dirty;
+  b->first_dirty = INT_MAX;
+  if (b->journal) journalMark(b->journal);
+}
+
+void editorFinishSave(struct Buffer *b) {
+  int err;
+  struct stat st;
+  ssize_t len = saveFinish(b->save, &err, &st);
+  b->save = NULL;
+
+  for (int i = 0; i < b->numorphans; i++) free(b->orphans[i]);
+  free(b->orphans);
+  b->orphans = NULL;
+  b->numorphans = 0;
 
-  char *buf = malloc(totlen);
-  char *p = buf;
-  for (j = 0; j < CURRENT_BUFFER->numrows; j++) {
-    memcpy(p, CURRENT_BUFFER->row[j].chars, CURRENT_BUFFER->row[j].size);
-    p += CURRENT_BUFFER->row[j].size;
-    *p = '\n';
-    p++;
+  if (len == -1) {
+    if (b->save_first_dirty < b->first_dirty) b->first_dirty = b->save_first_dirty;
+    editorSetStatusMessage("Can't save! I/O error: %s", strerror(err));
+  } else {
+    // Only the edits made before the snapshot are on disk now.
+    b->dirty -= b->save_dirty;
+    if (b->dirty < 0) b->dirty = 0;
+    b->disk = st;
+    b->disk_valid = 1;
+    b->follow_off = st.st_size;
+
+    // The journal only needs the edits the file doesn't have yet.
+    if (b->journal) b->journal = journalRebase(b->journal, &st);
+    b->journaling = 1;
+    b->follow_partial = 0;
+
+    // A rename gave the file a new inode, so a follow watch has to move
+    // over to it. Rows can keep borrowing from the old mapping, it stays
+    // valid after the rename.
+    if (b->follow_fd != -1 &&
+        inotify_add_watch(b->follow_fd, b->filename, IN_MODIFY) == -1) {
+      close(b->follow_fd);
+      b->follow_fd = -1;
+    }
+    editorSetStatusMessage("%zd bytes written to disk", len);
+  }
+
+  // Saves asked for in the meantime were folded into one.
+  if (b->save_pending) {
+    b->save_pending = 0;
+    editorStartSave(b);
+  }
+}
+
+void editorUnmap(struct Buffer *b) {
+  if (b->map) munmap(b->map, b->map_size);
+  b->map = NULL;
+  b->map_size = 0;
+}
+
+// Appends the lines starting at starts[] to b as rows that point straight
+// into its mapping, the last one running up to `end`. The rows of a batch
+// are allocated at once at their final count, and nothing is copied or
+// rendered until a row is first shown or edited.
+void editorAppendMappedLines(struct Buffer *b, size_t *starts, size_t count, size_t end) {
+  if (count == 0) return;
+
+  struct ropeNode *nodes = ropeNewSlab(b->rows, count);
+  if (nodes == NULL) die("ropeNewSlab");
+
+  char *map = b->map;
+  for (size_t i = 0; i < count; i++) {
+    size_t eol = (i + 1 < count) ? starts[i + 1] : end;
+    size_t linelen = eol - starts[i];
+    while (linelen > 0 && (map[starts[i] + linelen - 1] == '\n' ||
+                           map[starts[i] + linelen - 1] == '\r'))
+      linelen--;
+
+    erow *row = &nodes[i].row;
+    row->chars = map + starts[i];
+    row->size = linelen;
+    row->flags = ROW_MAPPED | ROW_STALE;
+    row->file_offset = starts[i];
+    if (b->wrap_width) nodes[i].height = editorRowHeight(b, row);
+
+    // Saving ends every row with "\n", so rows that end any other way
+    // differ from the file already.
+    if ((eol - starts[i] != linelen + 1 || map[eol - 1] != '\n') &&
+        (int)(b->numrows + i) < b->first_dirty)
+      b->first_dirty = b->numrows + i;
+  }
+
+  if (ropeAppendSlab(b->rows, nodes, count) == -1) die("ropeAppendSlab");
+  b->numrows += count;
+}
+
+// Indexes a mapped file on a background thread. Its rows are appended as
+// editorPollBackground picks them up, so the first screen can be drawn
+// and edited while the rest of the file streams in.
+void editorLoadMapping(char *map, size_t size) {
+  CURRENT_BUFFER->map = map;
+  CURRENT_BUFFER->map_size = size;
+
+  CURRENT_BUFFER->loader = lineLoaderStart(map, size);
+  if (CURRENT_BUFFER->loader) return;
+
+  size_t numlines;
+  size_t *starts = lineIndexBuild(map, size, &numlines);
+  if (starts == NULL) die("lineIndexBuild");
+  editorAppendMappedLines(CURRENT_BUFFER, starts, numlines, size);
+  free(starts);
+}
+
+/*** huge files ***/
+
+#define HUGE_WINDOW 512 // rows of a huge file kept in memory at once
+
+// Huge files are opened read-only, since only the window is ever there
+// to edit.
+int editorReadOnly() {
+  if (CURRENT_BUFFER->huge == NULL) return 0;
+  editorSetStatusMessage("Huge files are read-only");
+  return 1;
+}
+
+// Soft wrap needs the height of every row above the cursor, which a huge
+// file doesn't have, so its rows are always drawn unwrapped.
+int editorSoftWrapping() {
+  return E.soft_wrap && CURRENT_BUFFER->huge == NULL;
+}
+
+// How many screen lines a row takes up when soft wrapped. A row that
+// hasn't been rendered yet is measured from its text.
+int editorRowHeight(struct Buffer *b, erow *row) {
+  int width = row->rsize;
+  if (row->flags & ROW_STALE) {
+    width = 0;
+    for (int j = 0; j < row->size; j++)
+      width += row->chars[j] == '\t' ? b->tab_stop - width % b->tab_stop : 1;
+  }
+  return width / b->wrap_width + 1;
+}
+
+int editorCurrentRowHeight(erow *row) {
+  return editorRowHeight(CURRENT_BUFFER, row);
+}
+
+// Brings the row heights in the rope up to date for the screen width.
+// Rows keep their height current as they change, so every row is only
+// measured again when the width does.
+void editorWrapHeights() {
+  struct Buffer *b = CURRENT_BUFFER;
+  if (b->wrap_width == E.screencols - 5) return;
+  b->wrap_width = E.screencols - 5;
+  ropeSetHeights(b->rows, editorCurrentRowHeight);
+}
+
+// The row shown on screen line `line`, counted from the top of the file,
+// or numrows past the last row.
+int editorLineRow(int line) {
+  int offset;
+  editorWrapHeights();
+  erow *row = ropeAtHeight(CURRENT_BUFFER->rows, line, &offset);
+  return row ? ropeIndex(row) : CURRENT_BUFFER->numrows;
+}
+
+// The screen line the cursor is on, counted from the top of the file.
+int editorCursorLine() {
+  struct Buffer *b = CURRENT_BUFFER;
+  editorWrapHeights();
+  erow *row = editorRowAt(b->cy);
+  int line = row ? ropeHeightBefore(row) : ropeHeight(b->rows);
+  return line + b->rx / b->wrap_width;
+}
+
+struct hugeWindow {
+  struct ropeNode *nodes;
+  int count;
+};
+
+int editorHugeFillRow(void *arg, int line, char *s, size_t len) {
+  (void)line;
+  struct hugeWindow *w = arg;
+  erow *row = &w->nodes[w->count++].row;
+  row->chars = malloc(len + 1);
+  memcpy(row->chars, s, len + 1);
+  row->size = len;
+  row->flags = ROW_STALE;
+  return 0;
+}
+
+// Replaces the rows in memory with the window of lines around `at`. Any
+// erow pointer taken before this is gone afterwards.
+void editorHugeLoadWindow(struct Buffer *b, int at) {
+  int first = at - HUGE_WINDOW / 2;
+  if (first < 0) first = 0;
+  int last = first + HUGE_WINDOW;
+  if (last > b->numrows) last = b->numrows;
+
+  ropeFree(b->rows, editorFreeRow);
+  b->huge_first = first;
+
+  struct hugeWindow w;
+  w.nodes = ropeNewSlab(b->rows, last - first);
+  if (w.nodes == NULL) die("ropeNewSlab");
+  w.count = 0;
+  if (hugeFileReadLines(b->huge, first, last, editorHugeFillRow, &w) == -1)
+    editorSetStatusMessage("Can't read file! I/O error: %s", strerror(errno));
+  if (ropeAppendSlab(b->rows, w.nodes, w.count) == -1) die("ropeAppendSlab");
+}
+
+erow *editorHugeRowAt(struct Buffer *b, int at) {
+  if (at < 0 || at >= b->numrows) return NULL;
+
+  erow *row = ropeAt(b->rows, at - b->huge_first);
+  if (row) return row;
+
+  editorHugeLoadWindow(b, at);
+  return ropeAt(b->rows, at - b->huge_first);
+}
+
+// Opens the file as a huge file, leaving everything but the window of
+// rows on screen on disk. Returns 0 if that can't be done.
+int editorOpenHuge(int fd, off_t size) {
+  struct hugeFile *h = hugeFileOpen(fd, size);
+  if (h == NULL) return 0;
+
+  CURRENT_BUFFER->huge = h;
+  CURRENT_BUFFER->huge_first = 0;
+  CURRENT_BUFFER->syntax = NULL;
+  return 1;
+}
+
+struct hugeSearch {
+  char *query;
+  int match;
+};
+
+int editorHugeMatch(void *arg, int line, char *s, size_t len) {
+  (void)len;
+  struct hugeSearch *search = arg;
+  if (strstr(s, search->query) == NULL) return 0;
+  search->match = line;
+  return 1;
+}
+
+int editorHugeLastMatch(void *arg, int line, char *s, size_t len) {
+  (void)len;
+  struct hugeSearch *search = arg;
+  if (strstr(s, search->query)) search->match = line;
+  return 0;
+}
+
+// Streams through a huge file for the next line containing query after
+// (or before) line `from`, wrapping around at either end, without
+// touching the window. Going backwards is done a stride at a time.
+int editorHugeFind(struct Buffer *b, char *query, int from, int direction) {
+  struct hugeSearch search = {query, -1};
+
+  if (direction == 1) {
+    hugeFileReadLines(b->huge, from + 1, b->numrows, editorHugeMatch, &search);
+    if (search.match == -1)
+      hugeFileReadLines(b->huge, 0, from + 1, editorHugeMatch, &search);
+    return search.match;
+  }
+
+  int end = from;
+  for (int pass = 0; pass < 2 && search.match == -1; pass++) {
+    while (end > 0 && search.match == -1) {
+      int start = (end - 1) / HUGE_INDEX_STRIDE * HUGE_INDEX_STRIDE;
+      if (pass == 1 && start < from) start = from;
+      hugeFileReadLines(b->huge, start, end, editorHugeLastMatch, &search);
+      end = start;
+      if (pass == 1 && end == from) break;
+    }
+    end = b->numrows;
+  }
+  return search.match;
+}
+
+void editorPollLoader(struct Buffer *b) {
+  size_t *starts, count, end;
+  while (lineLoaderTake(b->loader, &starts, &count, &end)) {
+    editorAppendMappedLines(b, starts, count, end);
+    free(starts);
+  }
+  // Rows past where it stopped would be missing from the buffer, and from
+  // the file once it was saved.
+  if (lineLoaderFailed(b->loader)) {
+    errno = ENOMEM;
+    die("lineLoader");
+  }
+  if (lineLoaderDone(b->loader)) {
+    lineLoaderFree(b->loader);
+    b->loader = NULL;
+  }
+}
+
+/*** follow mode ***/
+
+#define FOLLOW_READ_BLOCK (64 << 10)
+
+// Adds bytes appended to the file as rows, continuing the last row if the
+// file used to end in the middle of a line. Appending isn't an edit, so
+// it doesn't change the dirty count or go into the undo history or the
+// journal.
+void editorFollowAppend(struct Buffer *b, char *data, size_t len) {
+  int dirty = b->dirty;
+  int journaling = b->journaling;
+  b->journaling = 0;
+  char *p = data;
+  char *end = data + len;
+  while (p < end) {
+    char *nl = memchr(p, '\n', end - p);
+    size_t linelen = (nl ? nl : end) - p;
+    if (nl) {
+      while (linelen > 0 && p[linelen - 1] == '\r') linelen--;
+    }
+
+    if (b->follow_partial && b->numrows > 0) {
+      editorRowAppendString(editorRowAt(b->numrows - 1), p, linelen);
+    } else {
+      editorInsertRow(b->numrows, p, linelen);
+    }
+    b->follow_partial = nl == NULL;
+    p = nl ? nl + 1 : end;
+  }
+  b->dirty = dirty;
+  b->journaling = journaling;
+}
+
+// Reads whatever was written to the file since it was last read. Only
+// called on the current buffer, since the row operations work on it.
+void editorFollowRead() {
+  struct Buffer *b = CURRENT_BUFFER;
+  int fd = open(b->filename, O_RDONLY);
+  if (fd == -1) return;
+
+  struct stat st;
+  if (fstat(fd, &st) == -1) {
+    close(fd);
+    return;
+  }
+  if (st.st_size < b->follow_off) {
+    // Truncated, like a rotated log. Carry on from its new start.
+    editorSetStatusMessage("%s was truncated", b->filename);
+    b->follow_off = 0;
+    b->follow_partial = 0;
+  }
+
+  int at_end = b->cy >= b->numrows - 1;
+  int past_end = b->cy == b->numrows;
+
+  char *block = malloc(FOLLOW_READ_BLOCK);
+  ssize_t n;
+  while (b->follow_off < st.st_size &&
+         (n = pread(fd, block, FOLLOW_READ_BLOCK, b->follow_off)) > 0) {
+    editorFollowAppend(b, block, n);
+    b->follow_off += n;
+  }
+  free(block);
+  close(fd);
+
+  // Keep the end of the file in view if that's where the cursor was.
+  if (at_end) {
+    b->cy = past_end ? b->numrows : b->numrows - 1;
+    if (b->cy < 0) b->cy = 0;
+    erow *row = editorRowAt(b->cy);
+    if (b->cx > (row ? row->size : 0)) b->cx = row ? row->size : 0;
+  }
+}
+
+// Gives every row a copy of its text and drops the mapping. A followed
+// file can be truncated in place, like a log rotated with copytruncate,
+// and reading a row from past the new end of the mapping would be a
+// SIGBUS. The loader and any running save read the mapping too, so they
+// are finished first.
+void editorDetachMapping(struct Buffer *b) {
+  if (b->map == NULL) return;
+  if (b->loader) {
+    lineLoaderWait(b->loader);
+    editorPollLoader(b);
+  }
+  while (b->save) editorFinishSave(b);
+  for (erow *row = ropeAt(b->rows, 0); row; row = ropeNext(row))
+    if (row->flags & ROW_MAPPED) editorRowCopyChars(b, row);
+  editorUnmap(b);
+}
+
+void editorToggleFollow() {
+  struct Buffer *b = CURRENT_BUFFER;
+  if (b->follow_fd != -1) {
+    close(b->follow_fd);
+    b->follow_fd = -1;
+    editorSetStatusMessage("Stopped following %s", b->filename);
+    return;
+  }
+
+  if (b->filename == NULL) {
+    editorSetStatusMessage("Nothing to follow, the buffer has no file");
+    return;
+  }
+  if (b->huge) {
+    editorSetStatusMessage("Huge files can't be followed");
+    return;
+  }
+
+  int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (fd == -1 || inotify_add_watch(fd, b->filename, IN_MODIFY) == -1) {
+    editorSetStatusMessage("Can't follow %s: %s", b->filename, strerror(errno));
+    if (fd != -1) close(fd);
+    return;
+  }
+  b->follow_fd = fd;
+  editorDetachMapping(b);
+  editorSetStatusMessage("Following %s (Ctrl-T to stop)", b->filename);
+
+  // Pick up anything written since the file was opened.
+  editorFollowRead();
+}
+
+// Returns 1 if the file has been written to since the last call.
+int editorFollowPending(struct Buffer *b) {
+  char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  int changed = 0;
+  while (read(b->follow_fd, events, sizeof(events)) > 0) changed = 1;
+  return changed;
+}
+
+// Picks up whatever background work has finished. While some is still
+// running, reading a key times out now and then so the screen keeps updating.
+void editorPollBackground() {
+  int busy = 0;
+  int highlighting = 0;
+  int redraw = 0; // something on screen may have changed since it was drawn
+  for (int i = 0; i < E.num_buffers; i++) {
+    struct Buffer *b = E.buffers[i];
+    int numrows = b->numrows;
+    if (b->loader) editorPollLoader(b);
+    if (b->loader) busy = 1;
+    if (b->huge) {
+      b->numrows = hugeFileLines(b->huge);
+      if (!hugeFileDone(b->huge)) busy = 1;
+    }
+    if (b->save) {
+      if (saveDone(b->save)) {
+        editorFinishSave(b);
+        redraw = 1;
+      } else {
+        busy = 1;
+      }
+    }
+    if (i == E.current_buffer) {
+      // Highlighting comes back quickly, so check for it more often.
+      if (b->hl_job && hlJobDone(b->hl_job)) {
+        editorFinishHighlight();
+        redraw = 1;
+      }
+      if (b->hl_job == NULL) editorStartHighlight();
+      if (b->hl_job) highlighting = 1;
+    }
+    if (b->journal && journalPending(b->journal)) {
+      busy = 1;
+      if (journalDue(b->journal) && journalFlush(b->journal) == -1)
+        editorSetStatusMessage("Can't write journal: %s", strerror(errno));
+    }
+    if (b->follow_fd != -1) {
+      busy = 1;
+      if (i == E.current_buffer && editorFollowPending(b))
+        editorFollowRead();
+    }
+    if (b->numrows != numrows) redraw = 1;
+  }
+  // Come straight back round to draw whatever just changed.
+  termTimeout(redraw ? 0 : highlighting ? 5 : busy ? 50 : -1);
+}
+
+/*** recovery ***/
+
+int editorReplayRecord(void *arg, int op, int at_row, int at, const char *s, int len) {
+  struct Buffer *b = arg;
+  erow *row = (at_row >= 0 && at_row < b->numrows) ? editorRowAt(at_row) : NULL;
+  if (at < 0 || len < 0) return 1;
+
+  switch (op) {
+    case JOURNAL_INSERT_ROW:
+      if (at_row < 0 || at_row > b->numrows) return 1;
+      editorInsertRow(at_row, (char *)s, len);
+      return 0;
+    case JOURNAL_DELETE_ROW:
+      if (row == NULL) return 1;
+      editorDelRow(at_row);
+      return 0;
+    case JOURNAL_INSERT:
+      if (row == NULL || at > row->size) return 1;
+      editorRowInsertString(row, at, s, len);
+      return 0;
+    case JOURNAL_DELETE:
+      if (row == NULL || at + len > row->size) return 1;
+      editorRowDelChar(row, at, len);
+      return 0;
   }
+  return 1;
+}
+
+// Offers to replay a journal left behind by an editor that never got to
+// save, then starts recording this buffer's edits. The journal was made
+// against the file as it is now, so replaying it only costs reading it.
+void editorRecover() {
+  struct Buffer *b = CURRENT_BUFFER;
+  if (!b->disk_valid) return;
+  b->journaling = 1;
+
+  char *path = journalPath(b->filename);
+  if (path == NULL) {
+    b->journaling = 0;
+    editorSetStatusMessage("Can't open journal: %s", strerror(ENOMEM));
+    return;
+  }
+  int found = journalCheck(path, &b->disk);
+  if (found == -1) {
+    editorSetStatusMessage("Ignoring %s, the file has changed since it was written", path);
+  } else if (found == 1) {
+    editorSetStatusMessage("Found unsaved changes to %s. Recover them? (y/n)", b->filename);
+    editorRefreshScreen();
+    int c;
+    while ((c = editorReadKey()) == TERM_KEY_NONE) editorPollBackground();
+
+    if (c == 'y' || c == 'Y') {
+      // Records refer to rows by number, so the whole file has to be in.
+      while (b->loader) {
+        editorPollLoader(b);
+        if (b->loader) usleep(1000);
+      }
 
-  return buf;
+      b->journaling = 0;
+      int n = journalReplay(path, editorReplayRecord, b);
+      if (n == -1) {
+        // Carrying on from a journal that couldn't be replayed would
+        // only lose the next edits too. Journaling resumes after a save.
+        editorSetStatusMessage("The journal is damaged, save to keep what was recovered");
+      } else {
+        b->journal = journalResume(path);
+        b->journaling = b->journal != NULL;
+        editorSetStatusMessage("Recovered %d changes from %s", n, path);
+      }
+    } else {
+      unlink(path);
+      editorSetStatusMessage("Discarded unsaved changes to %s", b->filename);
+    }
+  }
+  free(path);
 }
 
 void editorOpen(char *filename) {
@@ -767,18 +1827,55 @@ void editorOpen(char *filename) {
   FILE *fp = fopen(filename, "r");
   if (!fp) die("fopen");
 
+  struct stat st;
+  if (fstat(fileno(fp), &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    if (E.huge_files || (E.huge_threshold > 0 && st.st_size >= (off_t)E.huge_threshold << 20)) {
+      int fd = dup(fileno(fp));
+      if (fd != -1 && editorOpenHuge(fd, st.st_size)) {
+        fclose(fp);
+        CURRENT_BUFFER->dirty = 0;
+        return;
+      }
+      if (fd != -1) close(fd);
+    }
+
+    char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+    if (map != MAP_FAILED) {
+      fclose(fp);
+      CURRENT_BUFFER->disk = st;
+      CURRENT_BUFFER->disk_valid = 1;
+      CURRENT_BUFFER->follow_off = st.st_size;
+      CURRENT_BUFFER->follow_partial = map[st.st_size - 1] != '\n';
+      editorLoadMapping(map, st.st_size);
+      CURRENT_BUFFER->dirty = 0;
+      editorRecover();
+      return;
+    }
+  }
+
+  if (fstat(fileno(fp), &CURRENT_BUFFER->disk) == 0) CURRENT_BUFFER->disk_valid = 1;
+
   char *line = NULL;
   size_t linecap = 0;
   ssize_t linelen;
   while((linelen = getline(&line, &linecap, fp)) != -1) {
+    off_t start = CURRENT_BUFFER->follow_off;
+    ssize_t rawlen = linelen;
+    CURRENT_BUFFER->follow_off += linelen;
+    CURRENT_BUFFER->follow_partial = line[linelen - 1] != '\n';
     while (linelen > 0 && (line[linelen -1] == '\n' ||
                            line[linelen -1] == '\r'))
       linelen--;
+    int first_dirty = CURRENT_BUFFER->first_dirty;
     editorInsertRow(CURRENT_BUFFER->numrows, line, linelen);
+    editorRowAt(CURRENT_BUFFER->numrows - 1)->file_offset = start;
+    if (rawlen == linelen + 1 && line[linelen] == '\n')
+      CURRENT_BUFFER->first_dirty = first_dirty;
   }
   free(line);
   fclose(fp);
   CURRENT_BUFFER->dirty = 0;
+  editorRecover();
 }
 
 void editorNewBuffer() {
@@ -786,7 +1883,8 @@ void editorNewBuffer() {
   if (CURRENT_BUFFER->dirty) {
     editorSetStatusMessage("Current buffer has unsaved changes. Save? (y/n/ESC)");
     editorRefreshScreen();
-    int c = editorReadKey();
+    int c;
+    while ((c = editorReadKey()) == TERM_KEY_NONE) editorPollBackground();
     if (c == 'y' || c == 'Y') {
       editorSave();
       if (CURRENT_BUFFER->dirty) { // If save failed, don't create new buffer
@@ -834,11 +1932,11 @@ void editorShowBufferList() {
   int selected_buffer = E.current_buffer;
 
   while (1) {
-    attron(A_REVERSE);
+    termAttrOn(TERM_REVERSE);
     for (int i = 0; i < height; i++) {
-      mvprintw(start_y + i, start_x, "%*s", width, " ");
+      termPrintf(start_y + i, start_x, "%*s", width, " ");
     }
-    mvprintw(start_y, start_x + 1, " Open Buffers ");
+    termPrintf(start_y, start_x + 1, " Open Buffers ");
 
     for (int i = 0; i < E.num_buffers; i++) {
       if (i >= height - 2) break;
@@ -848,15 +1946,15 @@ void editorShowBufferList() {
       snprintf(buffer_entry, sizeof(buffer_entry), "%d: %s", i + 1, filename);
 
       if (i == selected_buffer) {
-        mvprintw(start_y + 1 + i, start_x + 1, "%s", buffer_entry);
+        termPrintf(start_y + 1 + i, start_x + 1, "%s", buffer_entry);
       } else {
-        attroff(A_REVERSE);
-        mvprintw(start_y + 1 + i, start_x + 1, "%s", buffer_entry);
-        attron(A_REVERSE);
+        termAttrOff(TERM_REVERSE);
+        termPrintf(start_y + 1 + i, start_x + 1, "%s", buffer_entry);
+        termAttrOn(TERM_REVERSE);
       }
     }
-    attroff(A_REVERSE);
-    refresh();
+    termAttrOff(TERM_REVERSE);
+    termRefresh();
 
     int c = editorReadKey();
     switch (c) {
@@ -869,7 +1967,7 @@ void editorShowBufferList() {
         if (selected_buffer >= E.num_buffers) selected_buffer = 0;
         break;
       case '\n':
-      case KEY_ENTER:
+      case TERM_KEY_ENTER:
         E.current_buffer = selected_buffer;
         goto end_loop;
       case '\x1b':
@@ -877,13 +1975,16 @@ void editorShowBufferList() {
     }
   }
 end_loop:
-  return;
+  editorDamageScreen();
 }
 
 void editorCloseBuffer() {
   static int quit_times = 3;
   struct Buffer *b = CURRENT_BUFFER;
 
+  // A save still being written has to land before the buffer goes.
+  while (b->save) editorFinishSave(b);
+
   if (b->dirty && quit_times > 0) {
     editorSetStatusMessage("WARNING!!! File has unsaved changes. "
                            "Press Ctrl-Q %d more times to quit.", quit_times);
@@ -891,18 +1992,26 @@ void editorCloseBuffer() {
     return;
   }
 
+  // Closing throws away unsaved edits on purpose, so nothing is left to
+  // recover.
+  if (b->journal) journalDiscard(b->journal);
+  b->journal = NULL;
+
   if (E.num_buffers <= 1) {
-    endwin();
+    termEnd();
     exit(0);
   }
 
   quit_times = E.quit_times; // Reset on successful close
 
   // --- Free all memory associated with the buffer ---
-  for (int i = 0; i < b->numrows; i++) {
-    editorFreeRow(&b->row[i]);
-  }
-  free(b->row);
+  if (b->loader) lineLoaderFree(b->loader);
+  if (b->huge) hugeFileClose(b->huge);
+  if (b->hl_job) hlJobFree(b->hl_job);
+  if (b->follow_fd != -1) close(b->follow_fd);
+  ropeFree(b->rows, editorFreeRow);
+  free(b->rows);
+  editorUnmap(b);
   free(b->filename);
   free(b->clipboard);
   for (int i = 0; i < b->undo_pos; i++) free(b->undo_stack[i].data);
@@ -926,7 +2035,7 @@ void editorCloseBuffer() {
 
 void editorShowHelp() {
   int width = 50;
-  int height = 21;
+  int height = 23;
   int start_y = (E.screenrows - height) / 2;
   int start_x = (E.screencols - width) / 2;
 
@@ -936,6 +2045,8 @@ void editorShowHelp() {
     "Ctrl-S: Save file",
     "Ctrl-Q: Quit / Close buffer",
     "Ctrl-F: Find text",
+    "Ctrl-P: Go to line or N%",
+    "Ctrl-T: Follow file (tail -f)",
     "Ctrl-G: Show this help",
     "",
     "Ctrl-N: New buffer",
@@ -952,27 +2063,37 @@ void editorShowHelp() {
   };
   int num_lines = sizeof(help_lines) / sizeof(help_lines[0]);
 
-  attron(A_REVERSE);
+  termAttrOn(TERM_REVERSE);
   for (int i = 0; i < height; i++) {
-    mvprintw(start_y + i, start_x, "%*s", width, " ");
+    termPrintf(start_y + i, start_x, "%*s", width, " ");
   }
 
   for (int i = 0; i < num_lines; i++) {
-    mvprintw(start_y + 1 + i, start_x + 2, "%s", help_lines[i]);
+    termPrintf(start_y + 1 + i, start_x + 2, "%s", help_lines[i]);
   }
-  mvprintw(start_y + height - 2, start_x + 2, "Press any key to continue...");
-  attroff(A_REVERSE);
-  refresh();
+  termPrintf(start_y + height - 2, start_x + 2, "Press any key to continue...");
+  termAttrOff(TERM_REVERSE);
+  termRefresh();
 
   while (1) {
-    int c = getch();
-    if (c != KEY_RESIZE) {
+    int c = termGetKey();
+    if (c == TERM_KEY_NONE) {
+      editorPollBackground();
+    } else if (c != TERM_KEY_RESIZE) {
       break;
     }
   }
+  editorDamageScreen();
 }
 
 void editorSave() {
+  if (editorReadOnly()) return;
+
+  if (CURRENT_BUFFER->loader) {
+    editorSetStatusMessage("Can't save while the file is still loading");
+    return;
+  }
+
   if (CURRENT_BUFFER->filename == NULL) {
     CURRENT_BUFFER->filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
     if (CURRENT_BUFFER->filename == NULL) {
@@ -998,26 +2119,13 @@ void editorSave() {
     free(response);
   }
 
-  int len;
-  char *buf = editorRowsToString(&len);
-
-  int fd = open(CURRENT_BUFFER->filename, O_RDWR | O_CREAT, 0644);
-  if (fd != -1) {
-    if (ftruncate(fd, len) != -1) {
-      if (write(fd, buf, len) == len) {
-        close(fd);
-        free(buf);
-        CURRENT_BUFFER->dirty = 0;
-        editorSetStatusMessage("%d bytes written to disk", len);
-        return;
-      }
-    };
-    close(fd);
+  if (CURRENT_BUFFER->save) {
+    CURRENT_BUFFER->save_pending = 1;
+    editorSetStatusMessage("Saving... will save again when done");
+    return;
   }
-
-  free(buf);
-  editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
-
+  editorStartSave(CURRENT_BUFFER);
+  if (CURRENT_BUFFER->save) editorSetStatusMessage("Saving...");
 }
 
 /*** find ***/
@@ -1026,22 +2134,16 @@ void editorFindCallback(char *query, int key){
   static int last_match = -1;
   static int direction = 1;
 
-  static int saved_hl_line;
-  static char *saved_hl = NULL;
-
-  if (saved_hl) {
-    memcpy(CURRENT_BUFFER->row[saved_hl_line].hl, saved_hl, CURRENT_BUFFER->row[saved_hl_line].rsize);
-    free(saved_hl);
-    saved_hl = NULL;
-  }
+  CURRENT_BUFFER->match_row = -1;
+  editorGapClose(CURRENT_BUFFER);
 
-  if (key == '\r' || key == '\x1b' || key == '\n' || key == KEY_ENTER) {
+  if (key == '\r' || key == '\x1b' || key == '\n' || key == TERM_KEY_ENTER) {
     last_match = -1;
     direction = 1;
     return;
-  } else if (key == KEY_RIGHT || key == KEY_DOWN) {
+  } else if (key == TERM_KEY_RIGHT || key == TERM_KEY_DOWN) {
     direction = 1;
-  } else if (key == KEY_LEFT || key == KEY_UP) {
+  } else if (key == TERM_KEY_LEFT || key == TERM_KEY_UP) {
     direction = -1;
   } else {
     last_match = -1;
@@ -1052,22 +2154,27 @@ void editorFindCallback(char *query, int key){
   int current = last_match;
   int i;
   for (i = 0; i < CURRENT_BUFFER->numrows; i++) {
-    current += direction;
-    if (current == -1) current = CURRENT_BUFFER->numrows - 1;
-    else if (current == CURRENT_BUFFER->numrows) current = 0;
+    if (CURRENT_BUFFER->huge) {
+      // Stream through the file rather than loading every row.
+      current = editorHugeFind(CURRENT_BUFFER, query, current, direction);
+      if (current == -1) break;
+    } else {
+      current += direction;
+      if (current == -1) current = CURRENT_BUFFER->numrows - 1;
+      else if (current == CURRENT_BUFFER->numrows) current = 0;
+    }
 
-    erow *row = &CURRENT_BUFFER->row[current];
-    char *match = strstr(row->render, query);
+    erow *row = editorRowReady(current);
+    char *match = memmem(row->render, row->rsize, query, strlen(query));
     if (match) {
       last_match = current;
       CURRENT_BUFFER->cy = current;
       CURRENT_BUFFER->cx = editorRowRxToCx(row, match - row->render);
       CURRENT_BUFFER->rowoff = CURRENT_BUFFER->numrows;
 
-      saved_hl_line = current;
-      saved_hl = malloc(row->rsize);
-      memcpy(saved_hl, row->hl, row->rsize);
-      memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
+      CURRENT_BUFFER->match_row = current;
+      CURRENT_BUFFER->match_rx = match - row->render;
+      CURRENT_BUFFER->match_len = strlen(query);
       break;
     }
   }
@@ -1092,31 +2199,16 @@ void editorFind() {
   }
 }
 
-/*** append buffer ***/
-
-struct abuf {
-  char *b;
-  int len;
-};
-
-#define ABUF_INIT {NULL, 0}
-
 /*** output ***/
 
 void editorScroll() {
   CURRENT_BUFFER->rx = 0;
   if (CURRENT_BUFFER->cy < CURRENT_BUFFER->numrows) {
-    CURRENT_BUFFER->rx = editorRowCxToRx(&CURRENT_BUFFER->row[CURRENT_BUFFER->cy], CURRENT_BUFFER->cx);
+    CURRENT_BUFFER->rx = editorRowCxToRx(editorRowAt(CURRENT_BUFFER->cy), CURRENT_BUFFER->cx);
   }
-  if (E.soft_wrap) {
+  if (editorSoftWrapping()) {
     CURRENT_BUFFER->coloff = 0; // No horizontal scrolling with soft warp
-    int display_y = 0;
-    // Calculate the total number of display lines up to the cursor's line
-    for (int i = 0; i < CURRENT_BUFFER->cy; i++) {
-      display_y += (CURRENT_BUFFER->row[i].rsize / (E.screencols - 5)) + 1;
-    }
-    // Add the display lines within the cursor's line
-    display_y += CURRENT_BUFFER->rx / (E.screencols - 5);
+    int display_y = editorCursorLine();
 
     if(display_y < CURRENT_BUFFER->rowoff) {
       CURRENT_BUFFER->rowoff = display_y;
@@ -1140,7 +2232,9 @@ void editorScroll() {
   }
  }
 
-int is_char_in_selection(int filerow, int char_idx) {
+// The columns of `filerow` inside the selection, as [*lo, *hi). Returns 0
+// if the row has none.
+int editorSelectionCols(int filerow, int *lo, int *hi) {
   if (!CURRENT_BUFFER->selection_active) return 0;
 
   int start_row, start_col, end_row, end_col;
@@ -1162,123 +2256,254 @@ int is_char_in_selection(int filerow, int char_idx) {
   if (filerow < start_row || filerow > end_row) {
     return 0;
   }
-  if (filerow == start_row && char_idx < start_col) {
-    return 0;
+  *lo = (filerow == start_row) ? start_col : 0;
+  *hi = (filerow == end_row) ? end_col : INT_MAX;
+  return *lo < *hi;
+}
+
+// Draws `len` cells of render text at (y, x) with the current attributes.
+// Printable runs go out in one call. Anything else is drawn on its own so
+// that its ^X or M-x form doesn't push the rest of the row along.
+void editorDrawText(int y, int x, const char *s, int len) {
+  int i = 0;
+  while (i < len) {
+    int j = i;
+    while (j < len && s[j] >= 32 && s[j] < 127) j++;
+    if (j > i) termPutText(y, x + i, &s[i], j - i);
+    if (j < len && s[j] != '\0') termPutChar(y, x + j, (unsigned char)s[j]);
+    i = j + 1;
   }
-  if (filerow == end_row && char_idx >= end_col) {
-    return 0;
+}
+
+// Walks a row's hl spans left to right while it is drawn.
+struct spanCursor {
+  hlSpan *span;
+  hlSpan *end;
+  int span_end; // the cell after the current span
+};
+
+void editorSpanStart(struct spanCursor *c, erow *row) {
+  c->span = row->hl;
+  c->end = row->hl + row->hl_spans;
+  c->span_end = c->span < c->end ? c->span->len : 0;
+}
+
+// Stores the hl of cell rx of row `at` in *hl and returns how many cells
+// from there on share it, at least one. The find match is drawn over the
+// row's own highlighting, which the highlighter thread can replace at any
+// time. rx can only move forward from one call to the next.
+int editorCellRun(struct spanCursor *c, int at, int rx, int *hl) {
+  struct Buffer *b = CURRENT_BUFFER;
+  if (at == b->match_row && rx >= b->match_rx && rx < b->match_rx + b->match_len) {
+    *hl = HL_MATCH;
+    return b->match_rx + b->match_len - rx;
   }
 
-  return 1;
+  while (c->span < c->end && c->span_end <= rx) {
+    c->span++;
+    if (c->span < c->end) c->span_end += c->span->len;
+  }
+  int run = INT_MAX;
+  *hl = HL_NORMAL;
+  if (c->span < c->end) {
+    *hl = c->span->hl;
+    run = c->span_end - rx;
+  }
+  if (at == b->match_row && rx < b->match_rx && b->match_rx - rx < run)
+    run = b->match_rx - rx;
+  return run;
+}
+
+// What a screen line showed when it was last drawn. A line is only drawn
+// again when this changes, or when the rows it shows were damaged since.
+struct lineSig {
+  struct Buffer *buffer;
+  int filerow;        // -1 for a "~" line, -2 for the welcome message
+  int offset;         // first render column shown
+  int sel_lo, sel_hi; // selected columns, where the selection is drawn
+  int match_rx, match_len;
+};
+
+// Has the whole screen drawn again, after something was drawn over it.
+void editorDamageScreen() {
+  E.drawn_rows = 0;
+}
+
+// Whether screen line y has to be drawn to show `sig`. If so, the line
+// is cleared for it.
+int editorLineChanged(int y, struct lineSig *sig, int all) {
+  struct Buffer *b = CURRENT_BUFFER;
+  if (sig->filerow >= 0 && sig->filerow == b->match_row) {
+    sig->match_rx = b->match_rx;
+    sig->match_len = b->match_len;
+  }
+  int changed = all || memcmp(&E.drawn[y], sig, sizeof(*sig)) != 0 ||
+                (sig->filerow >= b->damage_lo && sig->filerow < b->damage_hi);
+  E.drawn[y] = *sig;
+  if (changed) {
+    termMove(y, 0);
+    termClearToEol();
+  }
+  return changed;
 }
 
 void editorDrawRows() {
+  int all = 0;
+  if (E.drawn_rows != E.screenrows || E.drawn_cols != E.screencols) {
+    E.drawn = realloc(E.drawn, sizeof(struct lineSig) * (E.screenrows > 0 ? E.screenrows : 1));
+    E.drawn_rows = E.screenrows;
+    E.drawn_cols = E.screencols;
+    all = 1;
+  }
+
   int y;
   for (y = 0; y < E.screenrows; y++) {
-    if (E.soft_wrap) {
+    struct lineSig sig;
+    memset(&sig, 0, sizeof(sig));
+    sig.buffer = CURRENT_BUFFER;
+
+    if (editorSoftWrapping()) {
       int target_display_line = CURRENT_BUFFER->rowoff + y;
 
-      int filerow_idx = -1;
+      // Find which file row and which wrapped line within it corresponds to the target_display_line
       int line_offset_in_row = 0;
+      editorWrapHeights();
+      erow *row = ropeAtHeight(CURRENT_BUFFER->rows, target_display_line, &line_offset_in_row);
+      int filerow_idx = row ? ropeIndex(row) : -1;
 
-      // Find which file row and which wrapped line within it corresponds to the target_display_line
-      int display_line_counter = 0;
-      for (int i = 0; i < CURRENT_BUFFER->numrows; i++) {
-        int lines_for_this_row = (CURRENT_BUFFER->row[i].rsize / (E.screencols - 5)) + 1;
-        if (display_line_counter + lines_for_this_row > target_display_line) {
-          filerow_idx = i;
-          line_offset_in_row = target_display_line - display_line_counter;
-          break;
-        }
-        display_line_counter += lines_for_this_row;
-      }
+      // Asked for even when the line is left as it is, as below.
+      if (filerow_idx != -1) row = editorRowReady(filerow_idx);
+
+      sig.filerow = filerow_idx;
+      sig.offset = line_offset_in_row * (E.screencols - 5);
+      if (!editorLineChanged(y, &sig, all)) continue;
 
       if (filerow_idx != -1) {
-        erow *row = &CURRENT_BUFFER->row[filerow_idx];
         int start_char_offset = line_offset_in_row * (E.screencols - 5);
         
         if (start_char_offset >= row->rsize) {
-            mvprintw(y, 0, "~");
+            termPrintf(y, 0, "~");
             continue;
         }
 
         int len = row->rsize - start_char_offset;
         if (len > (E.screencols - 5)) len = (E.screencols - 5);
 
-        char *c = &row->render[start_char_offset];
-        unsigned char *hl = &row->hl[start_char_offset];
+        char *c = editorRowRender(row, start_char_offset, len);
 
         // Gutter: only for the first line of a wrapped row
         if (line_offset_in_row == 0) {
-          attron(A_DIM | COLOR_PAIR(editorSyntaxToColor(HL_GUTTER)));
-          mvprintw(y, 0, "%4d ", filerow_idx + 1);
-          attroff(A_DIM | COLOR_PAIR(editorSyntaxToColor(HL_GUTTER)));
+          termAttrOn(TERM_DIM | TERM_PAIR(editorSyntaxToColor(HL_GUTTER)));
+          termPrintf(y, 0, "%4d ", filerow_idx + 1);
+          termAttrOff(TERM_DIM | TERM_PAIR(editorSyntaxToColor(HL_GUTTER)));
         } else {
-          attron(A_DIM | COLOR_PAIR(editorSyntaxToColor(HL_GUTTER)));
-          mvprintw(y, 0, "   . "); // Indicate continuation
-          attroff(A_DIM | COLOR_PAIR(editorSyntaxToColor(HL_GUTTER)));
+          termAttrOn(TERM_DIM | TERM_PAIR(editorSyntaxToColor(HL_GUTTER)));
+          termPrintf(y, 0, "   . "); // Indicate continuation
+          termAttrOff(TERM_DIM | TERM_PAIR(editorSyntaxToColor(HL_GUTTER)));
         }
 
-        for (int j = 0; j < len; j++) {
-          attron(COLOR_PAIR(editorSyntaxToColor(hl[j])));
-          mvprintw(y, j + 5, "%c", c[j]);
-          attroff(COLOR_PAIR(editorSyntaxToColor(hl[j])));
+        struct spanCursor sc;
+        editorSpanStart(&sc, row);
+        for (int j = 0; j < len;) {
+          int hl;
+          int run = editorCellRun(&sc, filerow_idx, start_char_offset + j, &hl);
+          if (run > len - j) run = len - j;
+          termAttrOn(TERM_PAIR(editorSyntaxToColor(hl)));
+          editorDrawText(y, j + 5, &c[j], run);
+          termAttrOff(TERM_PAIR(editorSyntaxToColor(hl)));
+          j += run;
         }
       } else {
-         mvprintw(y, 0, "~");
+         termPrintf(y, 0, "~");
       }
     } else { // Original non-wrapped drawing logic
       int filerow = y + CURRENT_BUFFER->rowoff;
       if (filerow >= CURRENT_BUFFER->numrows) {
-        if (CURRENT_BUFFER->numrows == 0 && y == E.screenrows / 3) {
+        int welcome_line = CURRENT_BUFFER->numrows == 0 && y == E.screenrows / 3;
+        sig.filerow = welcome_line ? -2 : -1;
+        if (!editorLineChanged(y, &sig, all)) continue;
+        if (welcome_line) {
           char welcome[80];
           int welcomelen = snprintf(welcome, sizeof(welcome),
                                     "ThaweCode editor -- version %s", THAWECODE_VERSION);
           if (welcomelen > E.screencols) welcomelen = E.screencols;
           int padding = (E.screencols - welcomelen) / 2;
           if (padding) {
-            mvprintw(y, 0, "~");
+            termPrintf(y, 0, "~");
           }
-          mvprintw(y, padding, "%s", welcome);
+          termPrintf(y, padding, "%s", welcome);
         } else {
-          mvprintw(y, 0, "~");
+          termPrintf(y, 0, "~");
         }
       } else {
-        int len = CURRENT_BUFFER->row[filerow].rsize - CURRENT_BUFFER->coloff;
+        // Asked for even when the line is left as it is, so that rows
+        // without their highlighting yet get it.
+        erow *row = editorRowReady(filerow);
+        int sel_lo, sel_hi;
+        if (!editorSelectionCols(filerow, &sel_lo, &sel_hi)) sel_lo = sel_hi = INT_MAX;
+
+        sig.filerow = filerow;
+        sig.offset = CURRENT_BUFFER->coloff;
+        sig.sel_lo = sel_lo;
+        sig.sel_hi = sel_hi;
+        if (!editorLineChanged(y, &sig, all)) continue;
+
+        int len = row->rsize - CURRENT_BUFFER->coloff;
         if (len < 0) len = 0;
-        if (len > E.screencols) len = E.screencols;
-        char *c = &CURRENT_BUFFER->row[filerow].render[CURRENT_BUFFER->coloff];
-        unsigned char *hl = &CURRENT_BUFFER->row[filerow].hl[CURRENT_BUFFER->coloff];
-
-        attron(A_DIM | COLOR_PAIR(editorSyntaxToColor(HL_GUTTER)));
-        mvprintw(y, 0, "%4d ", filerow + 1);
-        attroff(A_DIM | COLOR_PAIR(editorSyntaxToColor(HL_GUTTER)));
-
-        for (int j = 0; j < len; j++) {
-          if (is_char_in_selection(filerow, CURRENT_BUFFER->coloff + j)) {
-            attron(A_REVERSE);
-          }
-
-          attron(COLOR_PAIR(editorSyntaxToColor(hl[j])));
-          mvprintw(y, j + 5, "%c", c[j]);
-          attroff(COLOR_PAIR(editorSyntaxToColor(hl[j])));
-
-          attroff(A_REVERSE);
+        if (len > E.screencols - 5) len = E.screencols - 5;
+        char *c = editorRowRender(row, CURRENT_BUFFER->coloff, len);
+
+        termAttrOn(TERM_DIM | TERM_PAIR(editorSyntaxToColor(HL_GUTTER)));
+        termPrintf(y, 0, "%4d ", filerow + 1);
+        termAttrOff(TERM_DIM | TERM_PAIR(editorSyntaxToColor(HL_GUTTER)));
+
+        struct spanCursor sc;
+        editorSpanStart(&sc, row);
+        for (int j = 0; j < len;) {
+          int hl;
+          int rx = CURRENT_BUFFER->coloff + j;
+          int run = editorCellRun(&sc, filerow, rx, &hl);
+          if (run > len - j) run = len - j;
+          // The selection is drawn reversed over the highlighting, so runs
+          // also end where it starts and stops.
+          int selected = rx >= sel_lo && rx < sel_hi;
+          int edge = selected ? sel_hi : sel_lo;
+          if (edge > rx && edge - rx < run) run = edge - rx;
+          termAttrOn(TERM_PAIR(editorSyntaxToColor(hl)) | (selected ? TERM_REVERSE : 0));
+          editorDrawText(y, j + 5, &c[j], run);
+          termAttrOff(TERM_PAIR(editorSyntaxToColor(hl)) | TERM_REVERSE);
+          j += run;
         }
       }
     }
   }
+  CURRENT_BUFFER->damage_lo = INT_MAX;
+  CURRENT_BUFFER->damage_hi = 0;
 }
 
 void editorDrawStatusBar() {
-  attron(A_REVERSE);
-  move(E.screenrows, 0);
-  clrtoeol();
+  termAttrOn(TERM_REVERSE);
+  termMove(E.screenrows, 0);
+  termClearToEol();
 
   char status[80], rstatus[80];
   int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
                      CURRENT_BUFFER->filename ? CURRENT_BUFFER->filename : "[No name]", CURRENT_BUFFER->numrows,
-                     CURRENT_BUFFER->dirty ? "(modified)" : " ");
+                     CURRENT_BUFFER->huge ? "(read-only)" : CURRENT_BUFFER->dirty ? "(modified)" : " ");
+  if (CURRENT_BUFFER->follow_fd != -1 && len < (int)sizeof(status)) {
+    len += snprintf(status + len, sizeof(status) - len, " following");
+    if (len >= (int)sizeof(status)) len = sizeof(status) - 1;
+  }
+  if (CURRENT_BUFFER->huge && !hugeFileDone(CURRENT_BUFFER->huge) && len < (int)sizeof(status)) {
+    int percent = hugeFileScanned(CURRENT_BUFFER->huge) * 100 / hugeFileSize(CURRENT_BUFFER->huge);
+    len += snprintf(status + len, sizeof(status) - len, " indexing %d%%", percent);
+    if (len >= (int)sizeof(status)) len = sizeof(status) - 1;
+  }
+  if (CURRENT_BUFFER->loader && len < (int)sizeof(status)) {
+    int percent = lineLoaderTaken(CURRENT_BUFFER->loader) * 100 / CURRENT_BUFFER->map_size;
+    len += snprintf(status + len, sizeof(status) - len, " loading %d%%", percent);
+    if (len >= (int)sizeof(status)) len = sizeof(status) - 1;
+  }
   int rlen = snprintf(rstatus, sizeof(rstatus), " %s | %d/%d | [%d/%d]",
                       CURRENT_BUFFER->syntax ? CURRENT_BUFFER->syntax->filetype : "no ft", CURRENT_BUFFER->cy + 1, CURRENT_BUFFER->numrows,
                       E.current_buffer + 1, E.num_buffers);
@@ -1297,49 +2522,44 @@ void editorDrawStatusBar() {
       memcpy(line + E.screencols - rlen, rstatus, rlen);
   }
 
-  mvprintw(E.screenrows, 0, "%s", line);
+  termPrintf(E.screenrows, 0, "%s", line);
 
-  attroff(A_REVERSE);
+  termAttrOff(TERM_REVERSE);
 }
 
 void editorDrawMessageBar() {
-  move(E.screenrows + 1, 0);
-  clrtoeol();
+  termMove(E.screenrows + 1, 0);
+  termClearToEol();
   int msglen = strlen(E.statusmsg);
   if (msglen > E.screencols) msglen = E.screencols;
   if (msglen && time(NULL) - E.statusmsg_time < 5) {
     char msg[msglen + 1];
     memcpy(msg, E.statusmsg, msglen);
     msg[msglen] = '\0';
-    mvprintw(E.screenrows + 1, 0, "%s", msg);
+    termPrintf(E.screenrows + 1, 0, "%s", msg);
   }
 }
 
 void editorRefreshScreen() {
   editorScroll();
 
-  erase(); // Clear screen (ncurses equivalent of \x1b[2J)
-  
+  // Only the lines that changed are cleared and drawn again.
   editorDrawRows();
   editorDrawStatusBar();
   editorDrawMessageBar();
 
   int final_cy, final_cx;
-  if (E.soft_wrap) {
-    int display_y = 0;
-    for (int i = 0; i < CURRENT_BUFFER->cy; i++) {
-      display_y += (CURRENT_BUFFER->row[i].rsize / (E.screencols - 5)) + 1;
-    }
-    display_y += CURRENT_BUFFER->rx / (E.screencols - 5);
+  if (editorSoftWrapping()) {
+    int display_y = editorCursorLine();
     final_cy = display_y - CURRENT_BUFFER->rowoff;
     final_cx = (CURRENT_BUFFER->rx % (E.screencols - 5)) + 5;
   } else {
     final_cy = CURRENT_BUFFER->cy - CURRENT_BUFFER->rowoff;
     final_cx = CURRENT_BUFFER->rx - CURRENT_BUFFER->coloff + 5;
   }
-  move(final_cy, final_cx);
+  termMove(final_cy, final_cx);
 
-  refresh(); // Refresh the screen (ncurses equivalent of write())
+  termRefresh(); // Send the frame to the terminal
 }
 
 void editorSetStatusMessage(const char *fmt, ...) {
@@ -1362,8 +2582,12 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
         editorSetStatusMessage(prompt, buf);
         editorRefreshScreen();
 
-        int c = getch(); // Use getch() directly
-        if (c == KEY_DC || c == CTRL_KEY('h') || c == KEY_BACKSPACE || c == 127) {
+        int c = termGetKey(); // Read the raw key, not editorReadKey()
+        if (c == TERM_KEY_NONE) {
+          editorPollBackground();
+          continue;
+        }
+        if (c == TERM_KEY_DELETE || c == CTRL_KEY('h') || c == TERM_KEY_BACKSPACE || c == 127) {
           if (buflen != 0) buf[--buflen] = '\0';
         } else if (c == '\x1b') {
           editorSetStatusMessage("");
@@ -1388,8 +2612,38 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
       }
     }
 
+// Jumps to a line number, or to a percentage of the way through the file.
+// In a huge file the percentage is of its size, so it works before the
+// whole file has been indexed.
+void editorGoto() {
+  char *query = editorPrompt("Go to line: %s (N or N%%, ESC to cancel)", NULL);
+  if (query == NULL) return;
+
+  int line;
+  size_t len = strlen(query);
+  if (query[len - 1] == '%') {
+    long long percent = atoll(query);
+    if (percent < 0) percent = 0;
+    if (percent > 100) percent = 100;
+    if (CURRENT_BUFFER->huge) {
+      line = hugeFileLineAt(CURRENT_BUFFER->huge, hugeFileSize(CURRENT_BUFFER->huge) * percent / 100);
+    } else {
+      line = CURRENT_BUFFER->numrows * percent / 100;
+    }
+  } else {
+    line = atoi(query) - 1;
+  }
+  free(query);
+
+  if (line >= CURRENT_BUFFER->numrows) line = CURRENT_BUFFER->numrows - 1;
+  if (line < 0) line = 0;
+  CURRENT_BUFFER->cy = line;
+  CURRENT_BUFFER->cx = 0;
+  if (!editorSoftWrapping()) CURRENT_BUFFER->rowoff = line;
+}
+
 void editorMoveCursor(int key) {
-  erow *row = (CURRENT_BUFFER->cy >= CURRENT_BUFFER->numrows) ? NULL : &CURRENT_BUFFER->row[CURRENT_BUFFER->cy];
+  erow *row = editorRowAt(CURRENT_BUFFER->cy);
 
   switch(key) {
     case ARROW_LEFT:
@@ -1397,7 +2651,7 @@ void editorMoveCursor(int key) {
         CURRENT_BUFFER->cx--;
       } else if (CURRENT_BUFFER->cy > 0) {
         CURRENT_BUFFER->cy--;
-        CURRENT_BUFFER->cx = CURRENT_BUFFER->row[CURRENT_BUFFER->cy].size;
+        CURRENT_BUFFER->cx = editorRowAt(CURRENT_BUFFER->cy)->size;
       }
       break;
     case ARROW_RIGHT:
@@ -1420,7 +2674,7 @@ void editorMoveCursor(int key) {
       break;
   }
 
-  row = (CURRENT_BUFFER->cy >= CURRENT_BUFFER->numrows) ? NULL : &CURRENT_BUFFER->row[CURRENT_BUFFER->cy];
+  row = editorRowAt(CURRENT_BUFFER->cy);
   int rowlen = row ? row -> size : 0;
   if (CURRENT_BUFFER->cx > rowlen) {
     CURRENT_BUFFER->cx = rowlen;
@@ -1431,7 +2685,12 @@ void editorProcessKeypress() {
   int c = editorReadKey();
 
   switch (c) {
-    case KEY_RESIZE: break;
+    case TERM_KEY_NONE:
+    case TERM_KEY_RESIZE:
+    case TERM_KEY_PASTE_END: break;
+    case TERM_KEY_PASTE_START:
+      editorReadPaste();
+      break;
     case '\n':
       editorInsertNewline();
       break;
@@ -1509,13 +2768,21 @@ void editorProcessKeypress() {
 
     case END_KEY:
       if (CURRENT_BUFFER->cy < CURRENT_BUFFER->numrows)
-        CURRENT_BUFFER->cx = CURRENT_BUFFER->row[CURRENT_BUFFER->cy].size;
+        CURRENT_BUFFER->cx = editorRowAt(CURRENT_BUFFER->cy)->size;
       break;
 
     case CTRL_KEY('f'):
       editorFind();
       break;
 
+    case CTRL_KEY('p'):
+      editorGoto();
+      break;
+
+    case CTRL_KEY('t'):
+      editorToggleFollow();
+      break;
+
     case BACKSPACE:
     case CTRL_KEY('h'):
     case DEL_KEY:
@@ -1526,10 +2793,17 @@ void editorProcessKeypress() {
     case PAGE_UP:
     case PAGE_DOWN:
       {
+        // With soft wrap rowoff counts screen lines, not rows.
+        int top = CURRENT_BUFFER->rowoff;
+        int bottom = CURRENT_BUFFER->rowoff + E.screenrows - 1;
+        if (editorSoftWrapping()) {
+          top = editorLineRow(top);
+          bottom = editorLineRow(bottom);
+        }
         if (c == PAGE_UP) {
-          CURRENT_BUFFER->cy = CURRENT_BUFFER->rowoff;
+          CURRENT_BUFFER->cy = top;
         } else if (c == PAGE_DOWN) {
-          CURRENT_BUFFER->cy = CURRENT_BUFFER->rowoff + E.screenrows - 1;
+          CURRENT_BUFFER->cy = bottom;
           if (CURRENT_BUFFER->cy > CURRENT_BUFFER->numrows) CURRENT_BUFFER->cy = CURRENT_BUFFER->numrows;
         }
 
@@ -1564,7 +2838,40 @@ void initBuffer(struct Buffer *b) {
   b->rowoff = 0;
   b->coloff = 0;
   b->numrows = 0;
-  b->row = NULL;
+  b->rows = malloc(sizeof(struct rope));
+  ropeInit(b->rows);
+  b->hl_valid = 0;
+  b->hl_stale_end = 0;
+  b->hl_done = 0;
+  b->hl_gen = 1;
+  b->hl_edits = 0;
+  b->hl_want_lo = 0;
+  b->hl_want_hi = 0;
+  b->hl_job = NULL;
+  b->damage_lo = INT_MAX;
+  b->damage_hi = 0;
+  b->wrap_width = 0;
+  b->match_row = -1;
+  b->gap_row = NULL;
+  b->map = NULL;
+  b->map_size = 0;
+  b->loader = NULL;
+  b->huge = NULL;
+  b->huge_first = 0;
+  b->follow_fd = -1;
+  b->follow_off = 0;
+  b->follow_partial = 0;
+  b->save = NULL;
+  b->save_pending = 0;
+  b->save_dirty = 0;
+  b->save_gen = 0;
+  b->save_first_dirty = INT_MAX;
+  b->first_dirty = INT_MAX;
+  b->disk_valid = 0;
+  b->journal = NULL;
+  b->journaling = 0;
+  b->orphans = NULL;
+  b->numorphans = 0;
   b->dirty = 0;
   b->filename = NULL;
   b->syntax = NULL;
@@ -1590,6 +2897,12 @@ void initEditor() {
   E.quit_times = 3;
   E.soft_wrap = 0;
   E.hard_wrap = 0;
+  E.huge_files = 0;
+  E.huge_threshold = 1024;
+  E.highlight_on_load = 0;
+  E.drawn = NULL;
+  E.drawn_rows = 0;
+  E.drawn_cols = 0;
 
   E.buffers = malloc(sizeof(struct Buffer *));
   E.buffers[0] = malloc(sizeof(struct Buffer));
@@ -1603,28 +2916,51 @@ void initEditor() {
 }
 
 int main(int argc, char *argv[]) {
-  initscr();               // Start ncurses mode
-  raw();                   // Go into raw mode (character-at-a-time)
-  noecho();                // Don't echo characters as they are typed
-  keypad(stdscr, TRUE);    // Enable F-keys, arrow keys, etc
-  start_color();           // Enable color support
+  // The backend has to be known before anything else touches the
+  // terminal, so it comes from the command line rather than the rc file.
+  int vt = 0;
+  for (int i = 1; i < argc; i++)
+    if (strcmp(argv[i], "--vt") == 0) vt = 1;
+  termInit(vt);
   initColors();
 
   initEditor();
   load_config();
 
-  if (argc >= 2) {
-    // If a filename is provided, open it in a new buffer
-    editorNewBuffer(); // Create a new buffer
-    editorOpen(argv[1]); // Open the file in the new buffer
+  char *filename = NULL;
+  int follow = 0;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--huge") == 0) E.huge_files = 1;
+    else if (strcmp(argv[i], "--follow") == 0) follow = 1;
+    else if (strcmp(argv[i], "--vt") != 0) filename = argv[i];
   }
 
+  // If a filename is provided, open it in a new buffer
+  if (filename) editorNewBuffer();
+
+  // Anything opening the file has to say replaces the help line.
   editorSetStatusMessage(
     "Ctrl-S: Save | Ctrl-Q: Quit | Ctrl-F: Find | Ctrl-G: Help");
 
+  if (filename) {
+    editorOpen(filename); // Open the file in the new buffer
+    if (follow) editorToggleFollow();
+  }
+
+  // Polling after drawing lets the highlighter start on the rows the
+  // screen just asked for before waiting for a key.
   while (1) {
     editorRefreshScreen();
+    editorPollBackground();
     editorProcessKeypress();
+    // Keys that are already waiting, like a burst of typing or a paste
+    // the terminal didn't bracket, are all handled before the next frame.
+    // Scrolling still follows the cursor after each, since keys like
+    // PAGE_DOWN start from where the screen is.
+    while (termKeyPending()) {
+      editorScroll();
+      editorProcessKeypress();
+    }
   }
 
   return 0;